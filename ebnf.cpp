@@ -1,4 +1,28 @@
+#include <set>
+
 #include "ebnf.hpp"
+#include "ebnf_disk_cache.hpp"
+#include "ebnf_sets.hpp"
+
+//
+// ebnf_hash
+//
+
+uint64_t ebnf_hash(const void *data, size_t length, uint64_t hash) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i=0; i<length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t ebnf_hash(const string &text, uint64_t hash) {
+    // length first, so "ab","c" and "a","bc" differ
+    uint64_t length = text.size();
+    hash = ebnf_hash(&length, sizeof(length), hash);
+    return ebnf_hash(text.data(), text.size(), hash);
+}
 
 //
 // config_point
@@ -56,6 +80,13 @@ string memory_file::name() {
     return _name;
 }
 
+const char *memory_file::bytes(unsigned int offset, unsigned int length) {
+    if (((size_t)offset + length) > data.length()) {
+        return 0;
+    }
+    return data.data() + offset;
+}
+
 
 bool memory_file::match(const config_point &where,
                         const string &utf8_string,
@@ -84,12 +115,114 @@ bool memory_file::match(const config_point &where,
     return false;
 }
 
+//
+// ebnf_budget
+//
+
+ebnf_budget::ebnf_budget():max_steps(0),
+                           max_depth(10000),
+                           max_nodes(0),
+                           max_bytes(0),
+                           max_seconds(0),
+                           furthest(shared_ptr<config_point>(), shared_ptr<config_file>()) {
+    start();
+}
+
+void ebnf_budget::start() {
+    exceeded          = none;
+    steps             = 0;
+    depth             = 0;
+    deepest           = 0;
+    nodes             = 0;
+    bytes             = 0;
+    empty_repetitions = 0;
+    furthest.reset(shared_ptr<config_file>());
+    rule_stack.clear();
+    stack.clear();
+    started = chrono::steady_clock::now();
+}
+
+// Called on the way into every parse, so keep it cheap:
+// the clock is only read every so often.
+
+bool ebnf_budget::enter(const ebnf_object *object, const config_point &where) {
+    depth++;
+    stack.push_back(object);
+
+    if (exceeded != none) {
+        return false;
+    }
+
+    steps++;
+    if (depth > deepest) {
+        deepest = depth;
+    }
+    if (!furthest.file || (where.byte_offset > furthest.byte_offset)) {
+        furthest = where;
+    }
+
+    if (max_steps && (steps > max_steps)) {
+        trip(steps_limit);
+    } else if (max_depth && (depth > max_depth)) {
+        trip(depth_limit);
+    } else if (max_nodes && (nodes > max_nodes)) {
+        trip(nodes_limit);
+    } else if (max_bytes && (bytes > max_bytes)) {
+        trip(bytes_limit);
+    } else if ((max_seconds > 0) && !(steps & 1023)) {
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - started;
+        if (elapsed.count() > max_seconds) {
+            trip(time_limit);
+        }
+    }
+    return exceeded == none;
+}
+
+// Same node and byte limits as enter, for trees that arrive whole.
+// False if one of them is exceeded.
+
+bool ebnf_budget::add_nodes(unsigned long count) {
+    nodes += count;
+    bytes += count * sizeof(parse_tree);
+
+    if (exceeded != none) {
+        return false;
+    }
+    if (max_nodes && (nodes > max_nodes)) {
+        trip(nodes_limit);
+    } else if (max_bytes && (bytes > max_bytes)) {
+        trip(bytes_limit);
+    }
+    return exceeded == none;
+}
+
+void ebnf_budget::trip(limit_t limit) {
+    exceeded = limit;
+    for (auto i:stack) {
+        if (!i->key.empty() && (rule_stack.empty() || (rule_stack.back() != i->key))) {
+            rule_stack.push_back(i->key);
+        }
+    }
+}
+
+const char *ebnf_budget::exceeded_name() const {
+    switch (exceeded) {
+        case none:        return "none";
+        case steps_limit: return "steps";
+        case depth_limit: return "depth";
+        case nodes_limit: return "nodes";
+        case bytes_limit: return "bytes";
+        case time_limit:  return "time";
+    }
+    return "unknown";
+}
+
 //
 // parse_tree
 //
 
 parse_tree::parse_tree(shared_ptr<ebnf_object> _owner,
-                       const config_point &_end):owner(_owner), end(_end) {}
+                       const config_point &_end):owner(_owner), start(_end.byte_offset), end(_end) {}
 
 void parse_tree::add_child(shared_ptr<ebnf_object> _owner,
                        const config_point &_end) {
@@ -98,6 +231,36 @@ void parse_tree::add_child(shared_ptr<ebnf_object> _owner,
     children.push_back(t);
 }
 
+bool parse_tree::collapsing() const {
+    return owner && ((owner->policy == ebnf_collapse) || (owner->policy == ebnf_drop));
+}
+
+// ebnf_object
+
+void ebnf_object::finish(parse_tree &tree) {
+    parse_tree &node(tree.children.back());
+    tree.end = node.end;
+
+    switch (policy) {
+        case ebnf_keep:
+        case ebnf_collapse: // nothing was added under it
+            break;
+        case ebnf_flatten:
+            if (!node.included) {
+                vector<parse_tree> children;
+                children.swap(node.children);
+                tree.children.pop_back();
+                tree.children.insert(tree.children.end(),
+                                     make_move_iterator(children.begin()),
+                                     make_move_iterator(children.end()));
+            }
+            break;
+        case ebnf_drop:
+            tree.children.pop_back();
+            break;
+    }
+}
+
 // ebnf_string
 
 ebnf_string::ebnf_string(const string &_value):value(_value) {
@@ -116,14 +279,36 @@ const string ebnf_string::description() {
     return "string";
 }
 
-bool ebnf_string::parse(parse_tree &tree) {
+bool ebnf_string::parse(parse_tree &tree, ebnf_budget &budget) {
+    ebnf_budget_scope scope(budget, this, tree.end);
+    if (!scope) {
+        return false;
+    }
+
+    unsigned int start = tree.end.byte_offset;
     if (tree.end.match(value, tree.end)) {
-        tree.add_child(shared_from_this(), tree.end);
+        if (!tree.collapsing()) {
+            tree.add_child(shared_from_this(), tree.end);
+            tree.children.back().start = start;
+            budget.node();
+            finish(tree);
+        }
         return true;
     }
     return false;
 }
 
+void ebnf_string::accept(ebnf_visitor &visitor) {
+    visitor.visit(*this);
+}
+
+shared_ptr<ebnf_object> ebnf_string::copy(ebnf_copies &copies) {
+    // nothing inside us to copy
+    auto rv = shared_from_this();
+    copies[this] = rv;
+    return rv;
+}
+
 // ebnf_group
 
 void ebnf_group::add(shared_ptr<ebnf_object> item) {
@@ -164,16 +349,31 @@ bool ebnf_alternation::match(const config_point &where,
     return false;
 }
 
-bool ebnf_alternation::parse(parse_tree &tree) {
-    
+bool ebnf_alternation::parse(parse_tree &tree, ebnf_budget &budget) {
+    ebnf_budget_scope scope(budget, this, tree.end);
+    if (!scope) {
+        return false;
+    }
+
+    // No node of our own: the alternative goes straight into tree
+    if (tree.collapsing() || (policy == ebnf_flatten)) {
+        for (auto &i:objects) {
+            if (i->parse(tree, budget)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     // Add ourself...
     tree.add_child(shared_from_this(), tree.end);
+    budget.node();
     
     parse_tree &our_tree(tree.children.back());
     
     for (auto &i:objects) {
-        if (i->parse(our_tree)) {
-            our_tree.end = our_tree.children.back().end;
+        if (i->parse(our_tree, budget)) {
+            finish(tree);
             return true;
         }
     }
@@ -183,6 +383,21 @@ bool ebnf_alternation::parse(parse_tree &tree) {
     return false;
 }
 
+void ebnf_alternation::accept(ebnf_visitor &visitor) {
+    visitor.visit(*this);
+}
+
+shared_ptr<ebnf_object> ebnf_alternation::copy(ebnf_copies &copies) {
+    auto rv = New();
+    rv->key = key;
+    rv->policy = policy;
+    copies[this] = rv;
+    for (auto &i:objects) {
+        rv->add(ebnf_copy(i, copies));
+    }
+    return rv;
+}
+
 // ebnf_concatenation
 
 ebnf_concatenation::ebnf_concatenation() {
@@ -208,34 +423,65 @@ bool ebnf_concatenation::match(const config_point &where,
     return true;
 }
 
-bool ebnf_concatenation::parse(parse_tree &tree) {
-    
+bool ebnf_concatenation::parse(parse_tree &tree, ebnf_budget &budget) {
+    ebnf_budget_scope scope(budget, this, tree.end);
+    if (!scope) {
+        return false;
+    }
+
+    // No node of our own: the items go straight into tree, and come
+    // out again if they don't all match
+    if (tree.collapsing() || (policy == ebnf_flatten)) {
+        size_t mark = tree.children.size();
+        config_point start(tree.end);
+        for (auto &i:objects) {
+            if (!i->parse(tree, budget)) {
+                tree.children.erase(tree.children.begin()+mark, tree.children.end());
+                tree.end = start;
+                return false;
+            }
+        }
+        return true;
+    }
+
     // Add ourself...
     
     tree.add_child(shared_from_this(), tree.end);
+    budget.node();
     
     parse_tree &our_tree(tree.children.back());
     
     for (auto &i:objects) {
         
-        if (!i->parse(our_tree)) {
+        if (!i->parse(our_tree, budget)) {
             // revert pushing us on... we didn't match.
             tree.children.pop_back();
             return false;
         }
-        our_tree.end = our_tree.children.back().end;
     }
     
-    if (!our_tree.children.empty()) {
-        our_tree.end = our_tree.children.back().end;
-    }
-
+    finish(tree);
     return true;
 }
 
+void ebnf_concatenation::accept(ebnf_visitor &visitor) {
+    visitor.visit(*this);
+}
+
+shared_ptr<ebnf_object> ebnf_concatenation::copy(ebnf_copies &copies) {
+    auto rv = New();
+    rv->key = key;
+    rv->policy = policy;
+    copies[this] = rv;
+    for (auto &i:objects) {
+        rv->add(ebnf_copy(i, copies));
+    }
+    return rv;
+}
+
 // ebnf_exception
 
-ebnf_exception::ebnf_exception() {
+ebnf_exception::ebnf_exception():excluded_known(false) {
 }
 
 shared_ptr<ebnf_exception> ebnf_exception::New() {
@@ -260,25 +506,118 @@ const string ebnf_exception::description() {
     
 }
 
+// Worked out on first use, so except_this has been linked by then
+const bitset<256> &ebnf_exception::excluded() {
+    if (!excluded_known) {
+        if (except_this) {
+            vector<shared_ptr<ebnf_object> > roots(1, except_this);
+            excluded_bytes = ebnf_sets::New(roots)->of(except_this).first_bytes;
+        }
+        excluded_known = true;
+    }
+    return excluded_bytes;
+}
+
+bool ebnf_exception::one_byte(const config_point &where, config_point &position_after) {
+    const char *next = where.file ? where.file->bytes(where.byte_offset, 1) : 0;
+    if (!next || excluded().test((unsigned char)*next)) {
+        return false;
+    }
+    position_after = where;
+    if (*next == '\n') {
+        position_after.cr();
+    } else {
+        position_after.advance();
+    }
+    return true;
+}
+
 bool ebnf_exception::match(const config_point &where,
                            config_point &position_after) {
-    
-    if ((!everything_here) || (everything_here->match(where, position_after))) {
-        config_point throw_away(where);
-        if (!except_this->match(where, throw_away)) {
-            return true;
-        }
+    if (!everything_here) {
+        return one_byte(where, position_after);
     }
-    return false;
+
+    config_point end(where);
+    if (!everything_here->match(where, end)) {
+        return false;
+    }
+    config_point except_end(where);
+    if (except_this && except_this->match(where, except_end) &&
+        (except_end.byte_offset == end.byte_offset)) {
+        return false;
+    }
+    position_after = end;
+    return true;
 }
 
-// This logic may be borked...
-// if it's "ana" and not "an" does it match or not?
+bool ebnf_exception::parse(parse_tree &tree, ebnf_budget &budget) {
+    ebnf_budget_scope scope(budget, this, tree.end);
+    if (!scope) {
+        return false;
+    }
 
-bool ebnf_exception::parse(parse_tree &tree) {
+    unsigned int start = tree.end.byte_offset;
+    if (!everything_here) {
+        if (!one_byte(tree.end, tree.end)) {
+            return false;
+        }
+        if (!tree.collapsing()) {
+            tree.add_child(shared_from_this(), tree.end);
+            tree.children.back().start = start;
+            budget.node();
+            finish(tree);
+        }
+        return true;
+    }
 
-    // punt for now...
-    return false;
+    // What everything_here matched, unless except_this matches all of it
+    config_point before(tree.end);
+    auto excepted = [&](const config_point &end) {
+        parse_tree scratch(shared_ptr<ebnf_object>(), before);
+        return except_this && except_this->parse(scratch, budget) &&
+               (scratch.end.byte_offset == end.byte_offset);
+    };
+
+    if (tree.collapsing()) {
+        if (!everything_here->parse(tree, budget)) {
+            return false;
+        }
+        if (excepted(tree.end)) {
+            tree.end = before;
+            return false;
+        }
+        return true;
+    }
+
+    tree.add_child(shared_from_this(), tree.end);
+    budget.node();
+
+    parse_tree &our_tree(tree.children.back());
+    if (!everything_here->parse(our_tree, budget) || excepted(our_tree.end)) {
+        tree.children.pop_back();
+        return false;
+    }
+    finish(tree);
+    return true;
+}
+
+void ebnf_exception::accept(ebnf_visitor &visitor) {
+    visitor.visit(*this);
+}
+
+shared_ptr<ebnf_object> ebnf_exception::copy(ebnf_copies &copies) {
+    auto rv = New();
+    rv->key = key;
+    rv->policy = policy;
+    copies[this] = rv;
+    if (everything_here) {
+        rv->everything_here = ebnf_copy(everything_here, copies);
+    }
+    if (except_this) {
+        rv->except_this = ebnf_copy(except_this, copies);
+    }
+    return rv;
 }
 
 // ebnf_repetition
@@ -301,19 +640,50 @@ const string ebnf_repetition::description() {
     return "repetition";
 }
 
-bool ebnf_repetition::parse(parse_tree &tree) {
+bool ebnf_repetition::parse(parse_tree &tree, ebnf_budget &budget) {
+    ebnf_budget_scope scope(budget, this, tree.end);
+    if (!scope) {
+        return false;
+    }
+
+    // No node of our own: the rounds go straight into tree
+    if (tree.collapsing() || (policy == ebnf_flatten)) {
+        size_t kept = tree.children.size();
+        config_point before(tree.end);
+        while (repeated->parse(tree, budget)) {
+            if (tree.end.byte_offset == before.byte_offset) {
+                tree.children.erase(tree.children.begin()+kept, tree.children.end());
+                tree.end = before;
+                budget.empty_repetitions++;
+                break;
+            }
+            before = tree.end;
+            kept = tree.children.size();
+        }
+        return true;
+    }
 
     // Add ourself...
     tree.add_child(shared_from_this(), tree.end);
+    budget.node();
     
     parse_tree &our_tree(tree.children.back());
     
-    int count=0;
-    while (repeated->parse(our_tree)) {
-        our_tree.end = our_tree.children.back().end;
-        count++;
+    size_t kept=0; // children from rounds that matched something
+    config_point before(our_tree.end);
+    while (repeated->parse(our_tree, budget)) {
+        if (our_tree.end.byte_offset == before.byte_offset) {
+            // Matched nothing, so it would match nothing forever...
+            our_tree.children.erase(our_tree.children.begin()+kept, our_tree.children.end());
+            our_tree.end = before;
+            budget.empty_repetitions++;
+            break;
+        }
+        before = our_tree.end;
+        kept = our_tree.children.size();
     }
     
+    finish(tree);
     return true; // matching 0 times is valid...
 }
 
@@ -323,6 +693,264 @@ bool ebnf_repetition::match(const config_point &where,
     return false;
 }
 
+void ebnf_repetition::accept(ebnf_visitor &visitor) {
+    visitor.visit(*this);
+}
+
+shared_ptr<ebnf_object> ebnf_repetition::copy(ebnf_copies &copies) {
+    auto rv = New();
+    rv->key = key;
+    rv->policy = policy;
+    rv->count = count;
+    copies[this] = rv;
+    if (repeated) {
+        rv->repeated = ebnf_copy(repeated, copies);
+    }
+    return rv;
+}
+
+// ebnf_token
+
+ebnf_token::ebnf_token(unsigned int _kind,
+                       bool _nullable,
+                       shared_ptr<ebnf_object> _source):kind(_kind), nullable(_nullable), source_rule(_source) {
+}
+
+shared_ptr<ebnf_token> ebnf_token::New(unsigned int kind,
+                                       bool nullable,
+                                       shared_ptr<ebnf_object> source) {
+    return shared_ptr<ebnf_token>(new ebnf_token(kind, nullable, source));
+}
+
+const string ebnf_token::description() {
+    return "token";
+}
+
+bool ebnf_token::match(const config_point &where,
+                       config_point &position_after) {
+    if (!where.file->tokenized()) {
+        return source_rule->match(where, position_after);
+    }
+    if (where.file->token(where, kind, position_after)) {
+        return true;
+    }
+    if (nullable) {
+        position_after = where;
+        return true;
+    }
+    return false;
+}
+
+bool ebnf_token::parse(parse_tree &tree, ebnf_budget &budget) {
+    ebnf_budget_scope scope(budget, this, tree.end);
+    if (!scope) {
+        return false;
+    }
+
+    if (!tree.end.file->tokenized()) {
+        return source_rule->parse(tree, budget);
+    }
+
+    // The lexer never makes empty tokens, so a rule that can be
+    // empty matches nothing when its token isn't here.
+    unsigned int start = tree.end.byte_offset;
+    if (tree.end.file->token(tree.end, kind, tree.end) || nullable) {
+        if (!tree.collapsing()) {
+            tree.add_child(shared_from_this(), tree.end);
+            tree.children.back().start = start;
+            budget.node();
+            finish(tree);
+        }
+        return true;
+    }
+    return false;
+}
+
+void ebnf_token::accept(ebnf_visitor &visitor) {
+    visitor.visit(*this);
+}
+
+shared_ptr<ebnf_object> ebnf_token::copy(ebnf_copies &copies) {
+    auto rv = shared_from_this();
+    copies[this] = rv;
+    return rv;
+}
+
+// ebnf_reference
+
+ebnf_reference::ebnf_reference(const string &name):rule_name(name), rule_id(ebnf_no_rule) {
+}
+
+shared_ptr<ebnf_reference> ebnf_reference::New(const string &name) {
+    return shared_ptr<ebnf_reference>(new ebnf_reference(name));
+}
+
+const string ebnf_reference::description() {
+    return "reference";
+}
+
+bool ebnf_reference::match(const config_point &where,
+                           config_point &position_after) {
+    auto rule = target.lock();
+    return rule && rule->match(where, position_after);
+}
+
+// The rule does its own budget accounting and adds its own node.
+// Held for the parse, so a grammar dropped meanwhile can't free it.
+
+bool ebnf_reference::parse(parse_tree &tree, ebnf_budget &budget) {
+    auto rule = target.lock();
+    return rule && rule->parse(tree, budget);
+}
+
+void ebnf_reference::accept(ebnf_visitor &visitor) {
+    visitor.visit(*this);
+}
+
+shared_ptr<ebnf_object> ebnf_reference::copy(ebnf_copies &copies) {
+    auto rv = New(rule_name);
+    rv->key = key;
+    rv->policy = policy;
+    copies[this] = rv;
+    auto rule = target.lock();
+    if (rule) {
+        rv->link(rule_id, ebnf_copy(rule, copies));
+    }
+    return rv;
+}
+
+void ebnf_reference::link(uint32_t id, shared_ptr<ebnf_object> rule) {
+    rule_id = id;
+    target  = rule;
+}
+
+// ebnf_copy
+
+shared_ptr<ebnf_object> ebnf_copy(const shared_ptr<ebnf_object> &object, ebnf_copies &copies) {
+    auto existing = copies.find(object.get());
+    if (existing != copies.end()) {
+        return existing->second;
+    }
+    return object->copy(copies);
+}
+
+// ebnf_children
+
+void ebnf_children::visit(ebnf_alternation &object) {
+    children = object.items();
+}
+
+void ebnf_children::visit(ebnf_concatenation &object) {
+    children = object.items();
+}
+
+void ebnf_children::visit(ebnf_exception &object) {
+    if (object.everything()) {
+        children.push_back(object.everything());
+    }
+    if (object.except()) {
+        children.push_back(object.except());
+    }
+}
+
+void ebnf_children::visit(ebnf_repetition &object) {
+    if (object.item()) {
+        children.push_back(object.item());
+    }
+}
+
+void ebnf_children::visit(ebnf_token &object) {
+    children.push_back(object.source());
+}
+
+void ebnf_children::visit(ebnf_include &object) {
+    children.push_back(object.path());
+    children.push_back(object.start());
+}
+
+void ebnf_children::visit(ebnf_reference &object) {
+    auto rule = object.rule();
+    if (rule) {
+        children.push_back(rule);
+    }
+}
+
+// ebnf_fingerprint
+
+// The parts of an object that ebnf_children doesn't cover
+class ebnf_fingerprinter:public ebnf_visitor {
+public:
+    uint64_t hash;
+
+    ebnf_fingerprinter(uint64_t _hash):hash(_hash) {}
+
+    virtual void visit(ebnf_string &object) {
+        hash = ebnf_hash(object.text(), hash);
+    }
+    virtual void visit(ebnf_exception &object) {
+        // which side(s) are there
+        uint64_t sides = (object.everything() ? 1 : 0) | (object.except() ? 2 : 0);
+        hash = ebnf_hash(&sides, sizeof(sides), hash);
+    }
+    virtual void visit(ebnf_token &object) {
+        uint64_t kind = object.token_kind();
+        hash = ebnf_hash(&kind, sizeof(kind), hash);
+    }
+    virtual void visit(ebnf_reference &object) {
+        hash = ebnf_hash(object.name(), hash); // even if it isn't linked yet
+    }
+};
+
+uint64_t ebnf_fingerprint(const vector<shared_ptr<ebnf_object> > &roots) {
+    // Objects are numbered in the order a depth first walk first sees
+    // them, and each is hashed with the numbers of its children
+    map<const ebnf_object *, uint64_t> number;
+    auto number_of = [&number](const ebnf_object *object) {
+        auto found = number.find(object);
+        if (found != number.end()) {
+            return found->second;
+        }
+        uint64_t n = number.size();
+        number[object] = n;
+        return n;
+    };
+
+    uint64_t hash = ebnf_hash_seed;
+    for (auto &i:roots) {
+        uint64_t n = number_of(i.get());
+        hash = ebnf_hash(&n, sizeof(n), hash);
+    }
+
+    vector<shared_ptr<ebnf_object> > pending(roots.rbegin(), roots.rend());
+    set<const ebnf_object *> done;
+    while (!pending.empty()) {
+        auto object = pending.back();
+        pending.pop_back();
+        if (!object || done.count(object.get())) {
+            continue;
+        }
+        done.insert(object.get());
+
+        hash = ebnf_hash(object->description(), hash);
+        hash = ebnf_hash(object->key, hash);
+        uint64_t policy = object->policy; // same grammar, different trees
+        hash = ebnf_hash(&policy, sizeof(policy), hash);
+
+        ebnf_fingerprinter details(hash);
+        object->accept(details);
+        hash = details.hash;
+
+        ebnf_children children;
+        object->accept(children);
+        for (auto &i:children.children) {
+            uint64_t n = number_of(i.get());
+            hash = ebnf_hash(&n, sizeof(n), hash);
+        }
+        pending.insert(pending.end(), children.children.rbegin(), children.children.rend());
+    }
+    return hash;
+}
+
 // ebnf_grammar
 
 ebnf_grammar::ebnf_grammar() {
@@ -335,21 +963,219 @@ shared_ptr<ebnf_grammar> ebnf_grammar::New() {
 void ebnf_grammar::add(string key, shared_ptr<ebnf_object> rhs) {
     rhs->key=key;
 
-    key_rhs.insert(pair<string, shared_ptr<ebnf_object> >(key, rhs));
+    if (key_rhs.insert(pair<string, shared_ptr<ebnf_object> >(key, rhs)).second) {
+        table[intern(key)] = rhs;
+        unlinked.push_back(rhs);
+    }
 }
 
+uint32_t ebnf_grammar::intern(const string &key) {
+    auto found = ids.find(key);
+    if (found != ids.end()) {
+        return found->second;
+    }
+    uint32_t id = names.size();
+    ids[key] = id;
+    names.push_back(key);
+    table.push_back(shared_ptr<ebnf_object>());
+    return id;
+}
 
-int ebnf_grammar::parse_file(parse_tree &parse_tree,
-                             string key) {
+uint32_t ebnf_grammar::id(const string &key) const {
+    auto found = ids.find(key);
+    if (found == ids.end()) {
+        return ebnf_no_rule;
+    }
+    return found->second;
+}
+
+const string &ebnf_grammar::name(uint32_t id) const {
+    static const string none;
+    return (id < names.size()) ? names[id] : none;
+}
+
+// Finds the references in what link walks
+class ebnf_reference_finder:public ebnf_visitor {
+public:
+    vector<shared_ptr<ebnf_reference> > &found;
+
+    ebnf_reference_finder(vector<shared_ptr<ebnf_reference> > &_found):found(_found) {}
+
+    virtual void visit(ebnf_reference &object) {
+        found.push_back(static_pointer_cast<ebnf_reference>(object.shared_from_this()));
+    }
+};
+
+vector<string> ebnf_grammar::link() {
+    vector<shared_ptr<ebnf_reference> > references;
+    references.swap(unresolved);
+
+    // Only objects link hasn't seen before.  References are always
+    // (re)linked to this grammar's numbers, even if they came from a
+    // module that was linked on its own.
+    ebnf_reference_finder finder(references);
+    vector<shared_ptr<ebnf_object> > pending;
+    pending.swap(unlinked);
+    while (!pending.empty()) {
+        auto object = pending.back();
+        pending.pop_back();
+        if (!object || !linked.insert(object.get()).second) {
+            continue;
+        }
+        object->accept(finder);
+
+        ebnf_children children;
+        object->accept(children);
+        pending.insert(pending.end(), children.children.begin(), children.children.end());
+    }
+
+    set<string> missing;
+    for (auto &i:references) {
+        uint32_t id = intern(i->name());
+        if (table[id]) {
+            i->link(id, table[id]);
+        } else {
+            i->link(ebnf_no_rule, shared_ptr<ebnf_object>()); // not whatever it had before
+            unresolved.push_back(i);
+            missing.insert(i->name());
+        }
+    }
+    return vector<string>(missing.begin(), missing.end());
+}
+
+bool ebnf_grammar::add_module(const ebnf_grammar &module) {
+    for (auto &i:module.key_rhs) {
+        if (key_rhs.count(i.first)) {
+            return false;
+        }
+    }
+    for (auto &i:module.key_rhs) {
+        add(i.first, i.second);
+    }
+    link();
+    return true;
+}
+
+bool ebnf_grammar::set_policy(const string &key, ebnf_tree_policy policy) {
+    auto found = rule(key);
+    if (!found) {
+        return false;
+    }
+    found->policy = policy;
+    return true;
+}
+
+// Finds the objects set_inner_policy applies to
+class ebnf_inner_finder:public ebnf_visitor {
+public:
+    vector<ebnf_object *> found;
+
+    virtual void visit(ebnf_alternation &object) { found.push_back(&object); }
+    virtual void visit(ebnf_concatenation &object) { found.push_back(&object); }
+    virtual void visit(ebnf_repetition &object) { found.push_back(&object); }
+};
+
+void ebnf_grammar::set_inner_policy(ebnf_tree_policy policy) {
+    ebnf_inner_finder finder;
+    vector<shared_ptr<ebnf_object> > pending;
+    set<const ebnf_object *> seen;
+    for (auto &i:key_rhs) {
+        pending.push_back(i.second);
+    }
+    while (!pending.empty()) {
+        auto object = pending.back();
+        pending.pop_back();
+        if (!object || !seen.insert(object.get()).second) {
+            continue;
+        }
+        if (object->key.empty()) {
+            object->accept(finder);
+        }
+        ebnf_children children;
+        object->accept(children);
+        pending.insert(pending.end(), children.children.begin(), children.children.end());
+    }
+    for (auto i:finder.found) {
+        i->policy = policy;
+    }
+}
+
+uint64_t ebnf_grammar::fingerprint() const {
+    vector<shared_ptr<ebnf_object> > roots;
+    uint64_t hash = ebnf_hash_seed;
+    for (auto &i:key_rhs) {
+        hash = ebnf_hash(i.first, hash);
+        roots.push_back(i.second);
+    }
+    uint64_t structure = ebnf_fingerprint(roots);
+    return ebnf_hash(&structure, sizeof(structure), hash);
+}
+
+shared_ptr<ebnf_object> ebnf_grammar::rule(const string &key) const {
     auto pair = key_rhs.find(key);
     if (pair==key_rhs.end()) {
+        return shared_ptr<ebnf_object>();
+    }
+    return pair->second;
+}
+
+shared_ptr<ebnf_object> ebnf_grammar::rule(uint32_t id) const {
+    if (id >= table.size()) {
+        return shared_ptr<ebnf_object>();
+    }
+    return table[id];
+}
+
+
+int ebnf_grammar::parse_file(parse_tree &parse_tree,
+                             string key) {
+    ebnf_budget budget;
+    return parse_file(parse_tree, key, budget);
+}
+
+int ebnf_grammar::parse_file(parse_tree &parse_tree,
+                             string key,
+                             ebnf_budget &budget) {
+    return parse_file(parse_tree, id(key), budget);
+}
+
+int ebnf_grammar::parse_file(parse_tree &parse_tree,
+                             uint32_t id,
+                             ebnf_budget &budget) {
+    if (!unlinked.empty()) {
+        link();
+    }
+
+    auto start = rule(id);
+    if (!start) {
         return -1; // no such key!
     }
+    const string &key(names[id]);
+
+    // Even for a cache hit, so nothing's left from the last parse
+    budget.start();
     
-    
-    if (pair->second->parse(parse_tree)) {
-        return 0;
+    // Only whole files are cached
+    bool cached = disk_cache && parse_tree.end.file &&
+                  !parse_tree.end.byte_offset && parse_tree.children.empty();
+    uint64_t grammar = 0;
+    if (cached) {
+        grammar = fingerprint();
+        int rv = disk_cache->load(*this, grammar, key, parse_tree, budget);
+        if (rv != -1) {
+            return rv;
+        }
     }
-    
-    return -2;
+
+    bool matched = start->parse(parse_tree, budget);
+
+    if (budget.exceeded != ebnf_budget::none) {
+        return -3; // gave up, see budget for why
+    }
+
+    int rv = matched ? 0 : -2;
+    if (cached) {
+        disk_cache->store(*this, grammar, key, parse_tree, rv);
+    }
+    return rv;
 }
@@ -9,10 +9,19 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <bitset>
 #include <memory> // for shared_ptr
+#include <chrono>
+#include <stdint.h>
 
 using namespace std;
 
+// 64 bit FNV-1a, for content addressing (see ebnf_parse_cache)
+static const uint64_t ebnf_hash_seed = 14695981039346656037ULL;
+uint64_t ebnf_hash(const void *data, size_t length, uint64_t hash=ebnf_hash_seed);
+uint64_t ebnf_hash(const string &text, uint64_t hash=ebnf_hash_seed);
+
 class config_file;
 
 struct config_point {
@@ -69,12 +78,29 @@ public:
     virtual bool match(const config_point &where,
                        const string &utf8_string,
                        config_point &position_after) = 0;
+
+    // Files that have been run through a lexer (see ebnf_lexer)
+    // can also match whole tokens.  Same rules as match:
+    // position_after only moves on a match.
+    virtual bool tokenized() { return false; }
+    virtual bool token(const config_point &where,
+                       unsigned int kind,
+                       config_point &position_after) { return false; }
+    virtual uint64_t lexer() { return 0; }      // ebnf_lexer::fingerprint, if tokenized
+
+    // Direct access to length bytes of the file at offset, if the
+    // file can give it (and the range is valid).  The pointer stays
+    // good as long as the file does.  Used to copy unchanged text
+    // out without building strings.
+    virtual const char *bytes(unsigned int offset, unsigned int length) { return 0; }
+    virtual unsigned int size() { return 0; }     // bytes in the file, if known
 };
 
 //
 // Simplest implementation of an in-memory config_file
 //
 class memory_file:public config_file {
+protected:
     string _name;
     string data;
     memory_file(string &name, string &data);
@@ -85,33 +111,161 @@ public:
     virtual bool match(const config_point &where,
                        const string &utf8_string,
                        config_point &position_after);
+    virtual const char *bytes(unsigned int offset, unsigned int length);
+    virtual unsigned int size() { return data.size(); }
     virtual string name(); // return a filename or reference to this object
+
+    const string &contents() const { return data; }
 };
 
 class ebnf_object;
+class ebnf_string;
+class ebnf_alternation;
+class ebnf_concatenation;
+class ebnf_exception;
+class ebnf_repetition;
+class ebnf_token;
+class ebnf_include;
+class ebnf_reference;
+class config_loader;
+class ebnf_parse_cache;
+class ebnf_disk_cache;
+
+// Walks the EBNF object graph without knowing the concrete classes.
+// Analyses (first/follow sets, completion, ...) derive from this
+// and only override what they care about.
+class ebnf_visitor {
+public:
+    virtual ~ebnf_visitor() {};
+
+    virtual void visit(ebnf_string &object) {};
+    virtual void visit(ebnf_alternation &object) {};
+    virtual void visit(ebnf_concatenation &object) {};
+    virtual void visit(ebnf_exception &object) {};
+    virtual void visit(ebnf_repetition &object) {};
+    virtual void visit(ebnf_token &object) {};
+    virtual void visit(ebnf_include &object) {};
+    virtual void visit(ebnf_reference &object) {};
+};
+
+// Original object -> its copy, see ebnf_object::copy
+typedef map<const ebnf_object *, shared_ptr<ebnf_object> > ebnf_copies;
 
 struct parse_tree {
     shared_ptr<ebnf_object> owner; // ebnf_object that matched
+    unsigned int start;            // byte offset the match starts at, in end's file
     config_point end;              // end point of match
     vector<parse_tree> children;   // children that matched
+    shared_ptr<const parse_tree> included; // tree of an included file (shared, so hands off)
     
     parse_tree();
     parse_tree(shared_ptr<ebnf_object> owner,
-               const config_point &end);
+               const config_point &end); // a match of nothing, at end
     void add_child(shared_ptr<ebnf_object> owner, const config_point &end);
+
+    // Being filled in by a collapsed or dropped object, so what's
+    // parsed into it only moves end and adds no nodes
+    bool collapsing() const;
+};
+
+// What an object's match turns into in the parse tree.  Most users
+// only want the named rules and the spans of the text they matched,
+// not a node for every alternation and character on the way.
+// Policies are applied as the parse goes, so what isn't wanted is
+// never built.  (See ebnf_grammar::set_policy)
+enum ebnf_tree_policy {
+    ebnf_keep,      // its own node, with what matched inside under it
+    ebnf_flatten,   // no node of its own: what matched inside goes in its place
+    ebnf_collapse,  // its own node with no children, covering what it matched
+    ebnf_drop       // no node at all
+};
+// Nodes keep where their match starts, so spans stay exact whatever
+// was dropped around them.
+
+// Limits on one parse, so untrusted input (or a bad grammar) can't
+// run for minutes or blow the stack.  0 means no limit.  Every
+// ebnf_object::parse enters the budget through an ebnf_budget_scope;
+// once a limit is hit every parse fails straight away and
+// parse_file returns -3 with the details left in here.
+
+struct ebnf_budget {
+    enum limit_t { none, steps_limit, depth_limit, nodes_limit, bytes_limit, time_limit };
+
+    // Limits
+    unsigned long max_steps;    // ebnf_object::parse calls
+    unsigned int  max_depth;    // nested parse calls
+    unsigned long max_nodes;    // parse_tree nodes added
+    unsigned long max_bytes;    // memory for those nodes
+    double        max_seconds;  // wall time
+
+    // What happened
+    limit_t       exceeded;
+    unsigned long steps;
+    unsigned int  depth;
+    unsigned int  deepest;
+    unsigned long nodes;
+    unsigned long bytes;
+    unsigned long empty_repetitions;   // repetitions cut short by an iteration that matched nothing
+    config_point  furthest;            // furthest point any parse got to
+    vector<string> rule_stack;         // named rules being parsed when a limit was hit
+
+    ebnf_budget();
+
+    void start();     // reset the counters, done by parse_file
+    bool enter(const ebnf_object *object, const config_point &where);
+    void leave() { depth--; stack.pop_back(); }
+    void node() { nodes++; bytes += sizeof(parse_tree); }
+    bool add_nodes(unsigned long count); // nodes not built by parse (a disk cache hit)
+    const char *exceeded_name() const;
+
+private:
+    vector<const ebnf_object *> stack;
+    chrono::steady_clock::time_point started;
+
+    void trip(limit_t limit);
+};
+
+// Enters the budget for the life of one parse call.
+// Tests false if the parse shouldn't go on.
+class ebnf_budget_scope {
+    ebnf_budget &budget;
+    bool entered;
+public:
+    ebnf_budget_scope(ebnf_budget &_budget, const ebnf_object *object, const config_point &where)
+        :budget(_budget), entered(_budget.enter(object, where)) {}
+    ~ebnf_budget_scope() { budget.leave(); }
+    operator bool() const { return entered; }
 };
 
 // Base class of most EBNF things...
 class ebnf_object:public enable_shared_from_this<ebnf_object> {
 public:
     string key; // ebnf 'identifier'
+    ebnf_tree_policy policy;
+
+    ebnf_object():policy(ebnf_keep) {}
 
     virtual const string description() { return "object"; }
     virtual bool match(const config_point &where,
                        config_point &position_after)=0;
-    virtual bool parse(parse_tree &tree)=0;
+    virtual bool parse(parse_tree &tree, ebnf_budget &budget)=0;
+    virtual void accept(ebnf_visitor &visitor)=0;
+
+    // Deep copy.  copies maps originals to their copies, so shared
+    // and recursive objects stay shared and recursive, and anything
+    // already in it is substituted rather than copied.
+    // Use ebnf_copy() rather than calling this directly.
+    virtual shared_ptr<ebnf_object> copy(ebnf_copies &copies)=0;
+
+protected:
+    // A successful parse moves tree.end to the end of the match.
+    // Objects that add a node call this once it has matched, to move
+    // tree.end and apply policy to the node.
+    void finish(parse_tree &tree);
 };
 
+shared_ptr<ebnf_object> ebnf_copy(const shared_ptr<ebnf_object> &object, ebnf_copies &copies);
+
 // Even "characters" are treated like "stings" because
 // this allows us to use utf-8 "characters" easily...
 
@@ -129,7 +283,11 @@ public:
     virtual bool match(const config_point &where,
                        config_point &position_after);
     
-    virtual bool parse(parse_tree &tree);
+    virtual bool parse(parse_tree &tree, ebnf_budget &budget);
+    virtual void accept(ebnf_visitor &visitor);
+    virtual shared_ptr<ebnf_object> copy(ebnf_copies &copies);
+
+    const string &text() const { return value; }
 };
 
 class ebnf_group:public ebnf_object {
@@ -140,7 +298,8 @@ public:
 
     virtual const string description();
     virtual void add(shared_ptr<ebnf_object> item);
-    
+
+    const vector<shared_ptr<ebnf_object> > &items() const { return objects; }
 };
 
 ebnf_group& operator<<(ebnf_group& group, shared_ptr<ebnf_object> item);
@@ -161,7 +320,9 @@ public:
     virtual bool match(const config_point &where,
                        config_point &position_after);
     
-    virtual bool parse(parse_tree &tree);
+    virtual bool parse(parse_tree &tree, ebnf_budget &budget);
+    virtual void accept(ebnf_visitor &visitor);
+    virtual shared_ptr<ebnf_object> copy(ebnf_copies &copies);
 
 };
 
@@ -178,16 +339,26 @@ public:
     
     virtual bool match(const config_point &where,
                        config_point &position_after);
-    bool parse(parse_tree &tree);
+    bool parse(parse_tree &tree, ebnf_budget &budget);
+    virtual void accept(ebnf_visitor &visitor);
+    virtual shared_ptr<ebnf_object> copy(ebnf_copies &copies);
 
 };
 
 // everything in set a but not in set b
 // (a - b)
+// A match of a that b doesn't match the whole of.  Without a, it's
+// any one byte that can't start a match of b: the same thing
+// ebnf_sets, ebnf_lexer and ebnf_completer take it to be.
 class ebnf_exception:public ebnf_object {
     ebnf_exception();
     shared_ptr<ebnf_object> everything_here;
     shared_ptr<ebnf_object> except_this;
+    bitset<256> excluded_bytes; // bytes that can start except_this
+    bool excluded_known;        // excluded_bytes has been worked out
+
+    const bitset<256> &excluded();
+    bool one_byte(const config_point &where, config_point &position_after);
 
 public:
     virtual ~ebnf_exception() {};
@@ -199,7 +370,13 @@ public:
     virtual const string description();
     virtual bool match(const config_point &where,
                        config_point &position_after);
-    bool parse(parse_tree &tree);
+    bool parse(parse_tree &tree, ebnf_budget &budget);
+    virtual void accept(ebnf_visitor &visitor);
+    virtual shared_ptr<ebnf_object> copy(ebnf_copies &copies);
+
+    // everything_here may be empty, meaning "anything"
+    shared_ptr<ebnf_object> everything() const { return everything_here; }
+    shared_ptr<ebnf_object> except() const { return except_this; }
 
 };
 
@@ -220,30 +397,158 @@ public:
     virtual bool match(const config_point &where,
                        config_point &position_after);
     
-    bool parse(parse_tree &tree);
+    bool parse(parse_tree &tree, ebnf_budget &budget);
+    virtual void accept(ebnf_visitor &visitor);
+    virtual shared_ptr<ebnf_object> copy(ebnf_copies &copies);
+
+    shared_ptr<ebnf_object> item() const { return repeated; }
 
 };
 
-// That's the end of the "fundamentals"...
+// A whole token from a table driven lexer (see ebnf_lexer)
+// Matches one token of its kind if the file was tokenized, or
+// falls back to parsing source (the rule the lexer compiled) if not.
 
+class ebnf_token:public ebnf_object {
+    unsigned int kind;
+    bool nullable;
+    shared_ptr<ebnf_object> source_rule;
 
-class ebnf_rule:public ebnf_group {
-    shared_ptr<ebnf_object> lhs, rhs;
-    ebnf_rule();
+    ebnf_token(unsigned int kind, bool nullable, shared_ptr<ebnf_object> source);
 public:
-    virtual ~ebnf_rule() {};
+    virtual ~ebnf_token() {};
+
+    static shared_ptr<ebnf_token> New(unsigned int kind,
+                                      bool nullable,
+                                      shared_ptr<ebnf_object> source);
 
-    static shared_ptr<ebnf_rule> New();
-    static shared_ptr<ebnf_rule> New(shared_ptr<ebnf_object> lhs,
-                                     shared_ptr<ebnf_object> rhs);
     virtual const string description();
-    
-    bool parse(parse_tree &tree);
 
+    virtual bool match(const config_point &where,
+                       config_point &position_after);
+
+    bool parse(parse_tree &tree, ebnf_budget &budget);
+    virtual void accept(ebnf_visitor &visitor);
+    virtual shared_ptr<ebnf_object> copy(ebnf_copies &copies);
+
+    unsigned int token_kind() const { return kind; }
+    shared_ptr<ebnf_object> source() const { return source_rule; }
 };
 
+// Includes another file:  path matches the file's name (quotes are
+// stripped), loader finds it, and it's parsed with start.  Parses go
+// through cache, so a file included many times is parsed once and
+// every include node shares the one tree (in parse_tree::included).
+// The included file's points have the include point as their
+// parent, which is also how include cycles are caught.  A shared
+// tree keeps the parent chain of the include that first parsed it.
+// (See ebnf_include.hpp)
+
+class ebnf_include:public ebnf_object {
+    shared_ptr<ebnf_object> path_rule;
+    shared_ptr<ebnf_object> start_rule;
+    shared_ptr<config_loader> loader;
+    shared_ptr<ebnf_parse_cache> cache;
+
+    ebnf_include(shared_ptr<ebnf_object> path,
+                 shared_ptr<ebnf_object> start,
+                 shared_ptr<config_loader> loader,
+                 shared_ptr<ebnf_parse_cache> cache);
+public:
+    virtual ~ebnf_include() {};
+
+    static shared_ptr<ebnf_include> New(shared_ptr<ebnf_object> path,
+                                        shared_ptr<ebnf_object> start,
+                                        shared_ptr<config_loader> loader,
+                                        shared_ptr<ebnf_parse_cache> cache);
+
+    virtual const string description();
+
+    virtual bool match(const config_point &where,
+                       config_point &position_after);
+
+    bool parse(parse_tree &tree, ebnf_budget &budget);
+    virtual void accept(ebnf_visitor &visitor);
+    virtual shared_ptr<ebnf_object> copy(ebnf_copies &copies);
+
+    shared_ptr<ebnf_object> path() const { return path_rule; }
+    shared_ptr<ebnf_object> start() const { return start_rule; }
+};
+
+// Rule numbers handed out by ebnf_grammar::intern
+static const uint32_t ebnf_no_rule = 0xffffffff;
+
+// A rule used by name.  Rules can then refer to themselves, to each
+// other, and to rules a module only adds later, without being wired
+// together by hand.  ebnf_grammar::link points it at the rule, and
+// from then on it hands parses straight over: no lookups, and no
+// node of its own in the tree.  Until then it matches nothing.  The
+// grammar owns the rule, so recursive grammars don't keep
+// themselves alive through their references; once the grammar is
+// gone the reference matches nothing again.
+
+class ebnf_reference:public ebnf_object {
+    string rule_name;
+    uint32_t rule_id;
+    weak_ptr<ebnf_object> target;
+
+    ebnf_reference(const string &name);
+public:
+    virtual ~ebnf_reference() {};
+
+    static shared_ptr<ebnf_reference> New(const string &name);
+
+    virtual const string description();
+
+    virtual bool match(const config_point &where,
+                       config_point &position_after);
+
+    bool parse(parse_tree &tree, ebnf_budget &budget);
+    virtual void accept(ebnf_visitor &visitor);
+    virtual shared_ptr<ebnf_object> copy(ebnf_copies &copies);
+
+    void link(uint32_t id, shared_ptr<ebnf_object> rule);
+
+    const string &name() const { return rule_name; }
+    uint32_t id() const { return rule_id; }                   // ebnf_no_rule until linked
+    shared_ptr<ebnf_object> rule() const { return target.lock(); }
+    bool linked() const { return !target.expired(); }
+};
+
+// That's the end of the "fundamentals"...
+
+// Collects the direct sub-objects of whatever it visits
+class ebnf_children:public ebnf_visitor {
+public:
+    vector<shared_ptr<ebnf_object> > children;
+
+    virtual void visit(ebnf_alternation &object);
+    virtual void visit(ebnf_concatenation &object);
+    virtual void visit(ebnf_exception &object);
+    virtual void visit(ebnf_repetition &object);
+    virtual void visit(ebnf_token &object);
+    virtual void visit(ebnf_include &object);
+    virtual void visit(ebnf_reference &object);
+};
+
+// Hash of the structure of everything reachable from roots (kinds,
+// keys, tree policies, strings, and how they're wired), so equal
+// grammars built separately hash the same
+uint64_t ebnf_fingerprint(const vector<shared_ptr<ebnf_object> > &roots);
+
 class ebnf_grammar {
     map<string, shared_ptr<ebnf_object> > key_rhs;
+    shared_ptr<ebnf_disk_cache> disk_cache;
+
+    // Rule names interned to dense numbers, and the rule for each
+    // number (empty until it's added).  link() only walks what was
+    // added since it last ran, plus references it couldn't resolve.
+    map<string, uint32_t> ids;
+    vector<string> names;
+    vector<shared_ptr<ebnf_object> > table;
+    vector<shared_ptr<ebnf_object> > unlinked;
+    vector<shared_ptr<ebnf_reference> > unresolved;
+    set<const ebnf_object *> linked;
 public:
     virtual ~ebnf_grammar() {};
 
@@ -252,8 +557,52 @@ public:
     static shared_ptr<ebnf_grammar> New();
 
     void add(string key, shared_ptr<ebnf_object> rhs);
+
+    // returns an empty pointer if there is no such rule
+    shared_ptr<ebnf_object> rule(const string &key) const;
+    shared_ptr<ebnf_object> rule(uint32_t id) const;
+    const map<string, shared_ptr<ebnf_object> > &rules() const { return key_rhs; }
+
+    // The number for a rule name, made on first use.  Rules don't have
+    // to exist to have a number.
+    uint32_t intern(const string &key);
+    uint32_t id(const string &key) const; // ebnf_no_rule if never interned
+    const string &name(uint32_t id) const;
+
+    // Point every ebnf_reference in the rules added since the last
+    // link at its rule, and retry the ones that couldn't be before.
+    // Returns the names that are still missing.  parse_file links
+    // anything new itself.
+    vector<string> link();
+
+    // Add the rules of a grammar fragment (say, from a module) and
+    // link them.  References either way between the fragment and
+    // what's here resolve; existing rules aren't touched.  Returns
+    // false, adding nothing, if it defines a rule that's already here.
+    bool add_module(const ebnf_grammar &module);
+
+    // How a rule's matches go into parse trees (it's a property of the
+    // rule, so everywhere it's used).  Returns false if there's no
+    // such rule.
+    bool set_policy(const string &key, ebnf_tree_policy policy);
+
+    // The same for the alternations, concatenations and repetitions
+    // inside rules, which don't have names of their own.  Strings,
+    // tokens and includes keep their nodes.
+    void set_inner_policy(ebnf_tree_policy policy);
+
+    uint64_t fingerprint() const;
+
+    // Keep parse_file results in cache (see ebnf_disk_cache), and use
+    // them rather than parsing a file that hasn't changed
+    void set_disk_cache(shared_ptr<ebnf_disk_cache> cache) { disk_cache = cache; }
     
+    // 0 on success, -1 no such rule, -2 no match, -3 over budget
+    // Without a budget only the depth is limited (so runaway
+    // recursion fails rather than crashing).
     int parse_file(parse_tree &parse_tree, string key);
+    int parse_file(parse_tree &parse_tree, string key, ebnf_budget &budget);
+    int parse_file(parse_tree &parse_tree, uint32_t id, ebnf_budget &budget);
 };
 
 #endif // __EBNF_HPP__
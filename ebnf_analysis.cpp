@@ -0,0 +1,821 @@
+#include <algorithm>
+#include <stdio.h>
+
+#include "ebnf_analysis.hpp"
+
+// Beyond these a set of strings is "could be anything"
+static const size_t start_strings_limit = 64;
+static const size_t start_length_limit  = 64;
+
+static const size_t no_node = (size_t)-1;
+
+//
+// ebnf_object_start
+//
+
+ebnf_object_start::ebnf_object_start():infallible(false), literal(false), prefixed(false) {}
+
+//
+// ebnf_finding
+//
+
+const char *ebnf_finding::kind_name(kind_t kind) {
+    switch (kind) {
+        case left_recursion:       return "left recursion";
+        case nullable_repetition:  return "nullable repetition";
+        case shadowed_alternative: return "shadowed alternative";
+        case first_overlap:        return "FIRST overlap";
+    }
+    return "unknown";
+}
+
+const char *ebnf_finding::cost_name(cost_t cost) {
+    switch (cost) {
+        case constant:    return "constant";
+        case linear:      return "linear";
+        case polynomial:  return "polynomial";
+        case exponential: return "exponential";
+        case unbounded:   return "unbounded";
+    }
+    return "unknown";
+}
+
+//
+// Helpers
+//
+
+// Fills in one node: what kind of object it is and what it parses
+
+class ebnf_parts:public ebnf_visitor {
+    const ebnf_sets &sets;
+    const unordered_map<const ebnf_object *, size_t> &index;
+    ebnf_analysis::node &target;
+
+    void part(const shared_ptr<ebnf_object> &object, bool at_start) {
+        if (!object || !index.count(object.get())) {
+            return;
+        }
+        size_t n = index.at(object.get());
+        target.parts.push_back(n);
+        if (at_start) {
+            target.left.push_back(n);
+        }
+    }
+public:
+    ebnf_parts(const ebnf_sets &_sets,
+               const unordered_map<const ebnf_object *, size_t> &_index,
+               ebnf_analysis::node &_target):sets(_sets), index(_index), target(_target) {}
+
+    virtual void visit(ebnf_string &object) {
+        target.kind = ebnf_analysis::node::terminal;
+        target.text = object.text();
+        target.name = "\"" + object.text() + "\"";
+    }
+
+    virtual void visit(ebnf_alternation &object) {
+        target.kind = ebnf_analysis::node::alternation;
+        for (auto &i:object.items()) {
+            part(i, true);
+        }
+    }
+
+    virtual void visit(ebnf_concatenation &object) {
+        target.kind = ebnf_analysis::node::concatenation;
+        bool at_start = true;
+        for (auto &i:object.items()) {
+            part(i, at_start);
+            at_start = at_start && i && sets.of(i).nullable;
+        }
+    }
+
+    // The exception is looked for where the match starts, too
+    virtual void visit(ebnf_exception &object) {
+        target.kind = ebnf_analysis::node::exception;
+        part(object.everything(), true);
+        part(object.except(), true);
+    }
+
+    virtual void visit(ebnf_repetition &object) {
+        target.kind = ebnf_analysis::node::repetition;
+        part(object.item(), true);
+    }
+
+    virtual void visit(ebnf_token &object) {
+        target.kind = ebnf_analysis::node::token;
+        part(object.source(), true);
+    }
+
+    // The included file is a different input, so only the path counts
+    virtual void visit(ebnf_include &object) {
+        target.kind = ebnf_analysis::node::include;
+        part(object.path(), true);
+    }
+
+    virtual void visit(ebnf_reference &object) {
+        target.kind = ebnf_analysis::node::reference;
+        target.name = object.name();
+        part(object.rule(), true);
+    }
+};
+
+// Tarjan's strongly connected components, without recursion.
+// Components come out after everything they lead to.
+
+static vector<vector<size_t> > strongly_connected(const vector<vector<size_t> > &edges) {
+    size_t size = edges.size();
+    vector<size_t> number(size, no_node);
+    vector<size_t> low(size, 0);
+    vector<bool> stacked(size, false);
+    vector<size_t> stack;
+    vector<pair<size_t, size_t> > calls; // node, next edge to follow
+    vector<vector<size_t> > rv;
+    size_t counter = 0;
+
+    auto enter = [&](size_t n) {
+        number[n] = low[n] = counter++;
+        stack.push_back(n);
+        stacked[n] = true;
+        calls.push_back(make_pair(n, (size_t)0));
+    };
+
+    for (size_t root=0; root<size; root++) {
+        if (number[root] != no_node) {
+            continue;
+        }
+        enter(root);
+        while (!calls.empty()) {
+            size_t n = calls.back().first;
+            if (calls.back().second < edges[n].size()) {
+                size_t next = edges[n][calls.back().second++];
+                if (number[next] == no_node) {
+                    enter(next);
+                } else if (stacked[next]) {
+                    low[n] = min(low[n], number[next]);
+                }
+                continue;
+            }
+            calls.pop_back();
+            if (!calls.empty()) {
+                size_t caller = calls.back().first;
+                low[caller] = min(low[caller], low[n]);
+            }
+            if (low[n] == number[n]) {
+                vector<size_t> component;
+                size_t member;
+                do {
+                    member = stack.back();
+                    stack.pop_back();
+                    stacked[member] = false;
+                    component.push_back(member);
+                } while (member != n);
+                rv.push_back(component);
+            }
+        }
+    }
+    return rv;
+}
+
+static bool cyclic(const vector<size_t> &component, const vector<vector<size_t> > &edges) {
+    if (component.size() > 1) {
+        return true;
+    }
+    auto &out(edges[component[0]]);
+    return find(out.begin(), out.end(), component[0]) != out.end();
+}
+
+static bool prefix_free(const set<string> &strings) {
+    // Anything starting with a string sorts straight after it
+    for (auto i=strings.begin(); i!=strings.end(); ) {
+        auto next = i;
+        if (++next == strings.end()) {
+            break;
+        }
+        if (next->compare(0, i->size(), *i) == 0) {
+            return false;
+        }
+        i = next;
+    }
+    return true;
+}
+
+// Every string of a followed by every string of b, if it stays in the limits
+static bool product(const set<string> &a, const set<string> &b, set<string> &result) {
+    if (a.size() * b.size() > start_strings_limit) {
+        return false;
+    }
+    for (auto &i:a) {
+        for (auto &j:b) {
+            if (i.size() + j.size() > start_length_limit) {
+                return false;
+            }
+            result.insert(i + j);
+        }
+    }
+    return true;
+}
+
+static bool starts_with(const string &text, const string &prefix) {
+    return text.compare(0, prefix.size(), prefix) == 0;
+}
+
+//
+// ebnf_analysis
+//
+
+ebnf_analysis::node::node():kind(terminal), looped(false), referenced(false) {}
+
+ebnf_analysis::ebnf_analysis() {
+}
+
+shared_ptr<ebnf_analysis> ebnf_analysis::New(const ebnf_grammar &grammar) {
+    auto rv = shared_ptr<ebnf_analysis>(new ebnf_analysis());
+
+    rv->object_sets = ebnf_sets::New(grammar);
+    rv->connect();
+    rv->label(grammar);
+
+    vector<vector<size_t> > parts;
+    for (auto &i:rv->nodes) {
+        parts.push_back(i.parts);
+    }
+    auto components = strongly_connected(parts);
+    rv->compute_starts(components);
+    rv->compute_loops(components);
+
+    rv->find_left_recursion();
+    rv->find_alternation_hazards();
+    rv->find_nullable_repetitions();
+
+    stable_sort(rv->found.begin(), rv->found.end(),
+                [](const ebnf_finding &a, const ebnf_finding &b) { return a.cost > b.cost; });
+    return rv;
+}
+
+size_t ebnf_analysis::slot(const shared_ptr<ebnf_object> &object) const {
+    auto found = index.find(object.get());
+    return (found == index.end()) ? no_node : found->second;
+}
+
+void ebnf_analysis::connect() {
+    auto &objects(object_sets->reachable());
+    for (size_t i=0; i<objects.size(); i++) {
+        index[objects[i].get()] = i;
+    }
+    nodes.resize(objects.size());
+    for (size_t i=0; i<objects.size(); i++) {
+        ebnf_parts parts(*object_sets, index, nodes[i]);
+        objects[i]->accept(parts);
+        if (!objects[i]->key.empty()) {
+            nodes[i].name = objects[i]->key;
+        }
+        if ((nodes[i].kind == node::reference) && !nodes[i].parts.empty()) {
+            nodes[nodes[i].parts[0]].referenced = true;
+        }
+    }
+}
+
+// Each object gets the first rule (in key order) it's part of, and
+// its place in it.  Other rules are where they're named, not where
+// they're used.
+
+void ebnf_analysis::label(const ebnf_grammar &grammar) {
+    auto &objects(object_sets->reachable());
+    vector<bool> labelled(nodes.size(), false);
+
+    for (auto &i:grammar.rules()) {
+        vector<pair<size_t, string> > pending(1, make_pair(slot(i.second), string()));
+        while (!pending.empty()) {
+            size_t n = pending.back().first;
+            string where = pending.back().second;
+            pending.pop_back();
+
+            if ((n == no_node) || labelled[n] ||
+                (!where.empty() && !objects[n]->key.empty())) {
+                continue;
+            }
+            labelled[n] = true;
+            nodes[n].rule  = i.first;
+            nodes[n].where = where;
+
+            if (!where.empty()) {
+                where += ", ";
+            }
+            auto &parts(nodes[n].parts);
+            for (size_t j=parts.size(); j-->0; ) {
+                string step;
+                switch (nodes[n].kind) {
+                    case node::alternation:   step = "alternative " + to_string(j+1); break;
+                    case node::concatenation: step = "item " + to_string(j+1); break;
+                    case node::exception:     step = j ? "exception" : "left side"; break;
+                    case node::repetition:    step = "repeated"; break;
+                    case node::token:         step = "source"; break;
+                    case node::include:       step = "path"; break;
+                    default:                  step = "rule"; break;
+                }
+                pending.push_back(make_pair(parts[j], where + step));
+            }
+        }
+    }
+
+    for (size_t n=0; n<nodes.size(); n++) {
+        if (!labelled[n]) {
+            nodes[n].where = objects[n]->description();
+        }
+    }
+}
+
+// Children before parents, so each object sees what its parts can
+// start with.  Inside a recursive component, parts that haven't been
+// worked out yet count as "could be anything", which only ever makes
+// the answer less precise, not wrong.
+
+void ebnf_analysis::compute_starts(const vector<vector<size_t> > &components) {
+    for (auto &component:components) {
+        // Always matching only depends on other objects always
+        // matching, so go round until it settles
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto n:component) {
+                auto &o(nodes[n]);
+                bool infallible = false;
+                switch (o.kind) {
+                    case node::terminal:
+                        infallible = o.text.empty();
+                        break;
+                    case node::alternation:
+                        for (auto i:o.parts) {
+                            infallible = infallible || nodes[i].start.infallible;
+                        }
+                        break;
+                    case node::concatenation:
+                        infallible = true;
+                        for (auto i:o.parts) {
+                            infallible = infallible && nodes[i].start.infallible;
+                        }
+                        break;
+                    case node::repetition:
+                        infallible = true; // matching 0 times is valid
+                        break;
+                    case node::token:
+                    case node::reference:
+                        infallible = !o.parts.empty() && nodes[o.parts[0]].start.infallible;
+                        break;
+                    case node::exception: // may always be excepted
+                    case node::include:   // the included file might not be there
+                        break;
+                }
+                if (infallible && !o.start.infallible) {
+                    o.start.infallible = true;
+                    changed = true;
+                }
+            }
+        }
+
+        for (auto n:component) {
+            auto &o(nodes[n]);
+            auto &start(o.start);
+            switch (o.kind) {
+                case node::terminal:
+                    start.literal  = true;
+                    start.prefixed = true;
+                    start.strings.insert(o.text);
+                    break;
+
+                case node::alternation: {
+                    if (o.parts.empty()) {
+                        break;
+                    }
+                    bool literal = true;
+                    bool prefixed = true;
+                    set<string> strings;
+                    for (auto i:o.parts) {
+                        auto &part(nodes[i].start);
+                        prefixed = prefixed && part.prefixed;
+                        literal  = literal && part.literal;
+                        strings.insert(part.strings.begin(), part.strings.end());
+                    }
+                    if (prefixed && (strings.size() <= start_strings_limit)) {
+                        // Only one alternative can match, so no order
+                        // to worry about
+                        start.literal  = literal && prefix_free(strings);
+                        start.prefixed = true;
+                        start.strings.swap(strings);
+                    }
+                    break;
+                }
+
+                case node::concatenation: {
+                    bool literal = true;
+                    set<string> strings;
+                    strings.insert(string());
+                    for (auto i:o.parts) {
+                        auto &part(nodes[i].start);
+                        set<string> longer;
+                        if (!part.prefixed || !product(strings, part.strings, longer)) {
+                            literal = false;
+                            break;
+                        }
+                        strings.swap(longer);
+                        if (!part.literal) {
+                            literal = false;
+                            break;
+                        }
+                    }
+                    start.literal  = literal;
+                    start.prefixed = true;
+                    start.strings.swap(strings);
+                    break;
+                }
+
+                case node::token:
+                case node::reference:
+                    if (!o.parts.empty()) {
+                        auto &part(nodes[o.parts[0]].start);
+                        start.literal  = part.literal;
+                        start.prefixed = part.prefixed;
+                        start.strings  = part.strings;
+                    }
+                    break;
+
+                case node::include: // matches the path, then may still fail
+                    if (!o.parts.empty()) {
+                        auto &part(nodes[o.parts[0]].start);
+                        start.prefixed = part.prefixed;
+                        start.strings  = part.strings;
+                    }
+                    break;
+
+                case node::exception:
+                case node::repetition:
+                    break;
+            }
+        }
+    }
+}
+
+// Parsed more than once in a single parse: part of a recursive
+// component, or anywhere under a repetition
+
+void ebnf_analysis::compute_loops(const vector<vector<size_t> > &components) {
+    vector<vector<size_t> > parts;
+    for (auto &i:nodes) {
+        parts.push_back(i.parts);
+    }
+
+    vector<size_t> pending;
+    for (auto &component:components) {
+        if (cyclic(component, parts)) {
+            pending.insert(pending.end(), component.begin(), component.end());
+        }
+    }
+    for (auto &i:nodes) {
+        if (i.kind == node::repetition) {
+            pending.insert(pending.end(), i.parts.begin(), i.parts.end());
+        }
+    }
+    while (!pending.empty()) {
+        size_t n = pending.back();
+        pending.pop_back();
+        if (nodes[n].looped) {
+            continue;
+        }
+        nodes[n].looped = true;
+        pending.insert(pending.end(), nodes[n].parts.begin(), nodes[n].parts.end());
+    }
+}
+
+bool ebnf_analysis::reaches(const vector<size_t> &from, size_t target) const {
+    vector<bool> seen(nodes.size(), false);
+    vector<size_t> pending(from);
+    while (!pending.empty()) {
+        size_t n = pending.back();
+        pending.pop_back();
+        if (n == target) {
+            return true;
+        }
+        if (seen[n]) {
+            continue;
+        }
+        seen[n] = true;
+        pending.insert(pending.end(), nodes[n].parts.begin(), nodes[n].parts.end());
+    }
+    return false;
+}
+
+// What a reference (to a reference...) ends up parsing
+size_t ebnf_analysis::resolve(size_t n) const {
+    for (size_t hops=0; (hops < nodes.size()) && (nodes[n].kind == node::reference); hops++) {
+        if (nodes[n].parts.empty()) {
+            break;
+        }
+        n = nodes[n].parts[0];
+    }
+    return n;
+}
+
+// The objects an alternative parses one after another
+vector<size_t> ebnf_analysis::sequence(size_t n) const {
+    n = resolve(n);
+    vector<size_t> rv;
+    if (nodes[n].kind == node::concatenation) {
+        for (auto i:nodes[n].parts) {
+            rv.push_back(resolve(i));
+        }
+    } else {
+        rv.push_back(n);
+    }
+    return rv;
+}
+
+// The same object, or the same string written twice
+bool ebnf_analysis::same(size_t a, size_t b) const {
+    return (a == b) ||
+           ((nodes[a].kind == node::terminal) && (nodes[b].kind == node::terminal) &&
+            (nodes[a].text == nodes[b].text));
+}
+
+// "alternative 3 (optional)"
+string ebnf_analysis::describe(const vector<size_t> &items, size_t i) const {
+    string rv = "alternative " + to_string(i+1);
+    auto &name(nodes[items[i]].name);
+    return name.empty() ? rv : rv + " (" + name + ")";
+}
+
+void ebnf_analysis::add(ebnf_finding::kind_t kind, ebnf_finding::cost_t cost, size_t object, const string &message) {
+    ebnf_finding f;
+    f.kind    = kind;
+    f.cost    = cost;
+    f.rule    = nodes[object].rule;
+    f.where   = nodes[object].where;
+    f.message = message;
+    found.push_back(f);
+}
+
+// A cycle in "parses before consuming anything" never consumes
+// anything, so it never ends
+
+void ebnf_analysis::find_left_recursion() {
+    vector<vector<size_t> > left;
+    for (auto &i:nodes) {
+        left.push_back(i.left);
+    }
+
+    auto components = strongly_connected(left);
+    for (auto c=components.rbegin(); c!=components.rend(); c++) {
+        auto component(*c);
+        if (!cyclic(component, left)) {
+            continue;
+        }
+        sort(component.begin(), component.end());
+        set<size_t> members(component.begin(), component.end());
+
+        // Start from a rule, preferably one used by name
+        size_t start = component[0];
+        for (auto n:component) {
+            if (!nodes[n].name.empty() && (nodes[n].kind != node::reference) &&
+                (nodes[start].name.empty() || (nodes[n].referenced && !nodes[start].referenced))) {
+                start = n;
+            }
+        }
+
+        // Shortest way round and back to start
+        vector<size_t> from(nodes.size(), no_node);
+        vector<size_t> pending(1, start);
+        size_t last = no_node;
+        for (size_t i=0; (i < pending.size()) && (last == no_node); i++) {
+            for (auto next:left[pending[i]]) {
+                if (next == start) {
+                    last = pending[i];
+                    break;
+                }
+                if (members.count(next) && (from[next] == no_node)) {
+                    from[next] = pending[i];
+                    pending.push_back(next);
+                }
+            }
+        }
+        vector<size_t> path;
+        for (size_t n=last; (n != no_node) && (n != start); n=from[n]) {
+            path.push_back(n);
+        }
+
+        string start_name = nodes[start].name.empty() ? nodes[start].where : nodes[start].name;
+        string text = start_name;
+        set<string> named;
+        for (auto i=path.rbegin(); i!=path.rend(); i++) {
+            if (!nodes[*i].name.empty() && (nodes[*i].kind != node::reference)) {
+                text += " -> " + nodes[*i].name;
+                named.insert(nodes[*i].name);
+            }
+        }
+        text += " -> " + start_name;
+        named.insert(nodes[start].name);
+
+        string others;
+        for (auto n:component) {
+            if (!nodes[n].name.empty() && (nodes[n].kind != node::reference) && !named.count(nodes[n].name)) {
+                others += (others.empty() ? "" : ", ") + nodes[n].name;
+            }
+        }
+
+        string message = text + " without consuming anything, so it recurses until the "
+                         "depth limit stops it (parse_file returns -3)";
+        if (!others.empty()) {
+            message += "; also through " + others;
+        }
+        add(ebnf_finding::left_recursion, ebnf_finding::unbounded, start, message);
+    }
+}
+
+void ebnf_analysis::find_nullable_repetitions() {
+    auto &objects(object_sets->reachable());
+    for (size_t n=0; n<nodes.size(); n++) {
+        if ((nodes[n].kind != node::repetition) || nodes[n].parts.empty() ||
+            !object_sets->of(objects[nodes[n].parts[0]]).nullable) {
+            continue;
+        }
+        add(ebnf_finding::nullable_repetition, ebnf_finding::constant, n,
+            "the repeated item can match nothing, so the repetition ends at the first "
+            "round that matches nothing, even if a later choice would have gone on "
+            "(counted in ebnf_budget::empty_repetitions)");
+    }
+}
+
+// Ordered choice: an alternative is only tried if every one before it
+// failed, and each try starts again from the same place
+
+void ebnf_analysis::find_alternation_hazards() {
+    auto &objects(object_sets->reachable());
+    for (size_t a=0; a<nodes.size(); a++) {
+        if (nodes[a].kind != node::alternation) {
+            continue;
+        }
+        auto &items(nodes[a].parts);
+
+        // Alternatives that can never be tried
+        vector<bool> shadowed(items.size(), false);
+        size_t always = no_node;
+        for (size_t j=0; j<items.size(); j++) {
+            if (always != no_node) {
+                shadowed[j] = true;
+                continue;
+            }
+            auto &later(nodes[items[j]].start);
+            if (later.prefixed && !later.strings.empty()) {
+                // Which of the ways it could start does an earlier
+                // (literal) alternative match first?
+                size_t covered = 0;
+                size_t by = no_node;
+                string example, example_by;
+                for (auto &p:later.strings) {
+                    for (size_t i=0; i<j; i++) {
+                        auto &earlier(nodes[items[i]].start);
+                        if (!earlier.literal) {
+                            continue;
+                        }
+                        auto l = find_if(earlier.strings.begin(), earlier.strings.end(),
+                                         [&p](const string &s) { return starts_with(p, s); });
+                        if (l != earlier.strings.end()) {
+                            covered++;
+                            if (by == no_node) {
+                                by = i;
+                                example = p;
+                                example_by = *l;
+                            }
+                            break;
+                        }
+                    }
+                }
+                if (covered == later.strings.size()) {
+                    shadowed[j] = true;
+                    add(ebnf_finding::shadowed_alternative, ebnf_finding::constant, a,
+                        describe(items, j) + " is never tried: " + describe(items, by) +
+                        " matches first wherever it could");
+                } else if (covered && later.literal) {
+                    add(ebnf_finding::shadowed_alternative, ebnf_finding::constant, a,
+                        describe(items, j) + " can't match \"" + example + "\": " +
+                        describe(items, by) + " matches \"" + example_by + "\" first");
+                }
+            }
+            if (nodes[items[j]].start.infallible) {
+                always = j;
+            }
+        }
+        if ((always != no_node) && (always+1 < items.size())) {
+            string message = describe(items, always) + " always matches, so ";
+            message += (always+2 == items.size()) ? "alternative " + to_string(always+2) + " is" :
+                       "alternatives " + to_string(always+2) + "-" + to_string(items.size()) + " are";
+            add(ebnf_finding::shadowed_alternative, ebnf_finding::constant, a, message + " never tried");
+        }
+
+        // Alternatives that can start the same way, so a later one
+        // may have to parse what an earlier one already did
+        string pairs;
+        size_t overlaps = 0;
+        ebnf_finding::cost_t worst = ebnf_finding::constant;
+        string worst_reason;
+        for (size_t j=0; j<items.size(); j++) {
+            for (size_t i=0; i<j; i++) {
+                if (shadowed[i] || shadowed[j]) {
+                    continue;
+                }
+                bitset<256> common = object_sets->of(objects[items[i]]).first_bytes &
+                                     object_sets->of(objects[items[j]]).first_bytes;
+                if (common.none()) {
+                    continue;
+                }
+
+                auto first  = sequence(items[i]);
+                auto second = sequence(items[j]);
+                vector<size_t> shared;
+                while ((shared.size() < first.size()) && (shared.size() < second.size()) &&
+                       same(first[shared.size()], second[shared.size()])) {
+                    shared.push_back(first[shared.size()]);
+                }
+
+                ebnf_finding::cost_t cost;
+                string reason;
+                string both = to_string(i+1) + " and " + to_string(j+1);
+                string earlier = nodes[items[i]].name.empty() ? to_string(i+1) :
+                                 to_string(i+1) + " (" + nodes[items[i]].name + ")";
+                size_t again = no_node; // what both parse that can get back here
+                for (auto k:shared) {
+                    if (reaches(vector<size_t>(1, k), a)) {
+                        again = k;
+                        break;
+                    }
+                }
+                if (again != no_node) {
+                    cost = ebnf_finding::exponential;
+                    string name = nodes[again].name.empty() ? nodes[again].where : nodes[again].name;
+                    reason = both + " both start by parsing " + name + ", which leads back here, "
+                             "so every level of nesting is parsed twice";
+                } else if (nodes[items[i]].start.literal) {
+                    cost = ebnf_finding::constant;
+                    reason = earlier + " can only read a few bytes before it fails";
+                } else {
+                    cost = nodes[a].looped ? ebnf_finding::polynomial : ebnf_finding::linear;
+                    reason = earlier + " can read any amount of input before it fails";
+                    if (nodes[a].looped) {
+                        reason += ", and this is parsed in a loop";
+                    }
+                }
+                reason += " (both can start with " + ebnf_bytes_text(common) + ")";
+
+                if (!overlaps || (cost > worst)) {
+                    worst = cost;
+                    worst_reason = reason;
+                }
+                pairs += (overlaps++ ? ", " : "") + both;
+            }
+        }
+        if (overlaps) {
+            add(ebnf_finding::first_overlap, worst, a,
+                "alternatives " + pairs +
+                " can start with the same byte, so when the earlier one fails the later one "
+                "parses that input again; " + worst_reason);
+        }
+    }
+}
+
+ebnf_finding::cost_t ebnf_analysis::worst() const {
+    return found.empty() ? ebnf_finding::constant : found[0].cost;
+}
+
+string ebnf_bytes_text(const bitset<256> &bytes) {
+    auto byte_text = [](int c) {
+        switch (c) {
+            case '\n': return string("\\n");
+            case '\r': return string("\\r");
+            case '\t': return string("\\t");
+            case ' ':  return string("' '");
+        }
+        if ((c < ' ') || (c > '~')) {
+            char hex[8];
+            snprintf(hex, sizeof(hex), "\\x%02x", c);
+            return string(hex);
+        }
+        return string(1, (char)c);
+    };
+
+    string rv;
+    for (int c=0; c<256; c++) {
+        if (!bytes[c]) {
+            continue;
+        }
+        int last = c;
+        while ((last+1 < 256) && bytes[last+1]) {
+            last++;
+        }
+        if (!rv.empty()) {
+            rv += " ";
+        }
+        rv += byte_text(c);
+        if (last >= c+2) {
+            rv += "-" + byte_text(last);
+            c = last;
+        }
+    }
+    return rv;
+}
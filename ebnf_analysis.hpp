@@ -0,0 +1,124 @@
+/*
+ * Performance hazards in an ebnf_grammar
+ *
+ * ebnf_object::parse is a plain backtracking parser.  Alternations
+ * are ordered choice (the first alternative that matches wins and
+ * the rest aren't tried), failed concatenations are thrown away
+ * whole, and nothing is memoized.  A grammar that reads fine can be
+ * slow or wrong under those rules, and it only shows on the inputs
+ * that hit the bad spot.  ebnf_analysis looks for the usual culprits
+ * in the grammar itself, using the nullable/FIRST sets of ebnf_sets:
+ *
+ *   left recursion         a rule that reaches itself without
+ *                          consuming anything (rhs in ebnf_parser).
+ *                          It never finishes; only the budget's
+ *                          depth limit stops it.
+ *   nullable repetition    { x } where x can match nothing.  The
+ *                          repetition ends at the first empty round,
+ *                          which is rarely what was meant.
+ *   shadowed alternative   a | b where a matches wherever b would,
+ *                          so b is never tried ("<" | "<=").
+ *   FIRST overlap          a | b where both can start with the same
+ *                          byte, so when a fails part way through b
+ *                          parses the same input again.
+ *
+ * Each finding comes with an estimate of its worst case cost in the
+ * length of the input.  The estimates are conservative about what
+ * they claim: a shadowed alternative is only reported when it can be
+ * shown (from literal strings), and an overlap is only called
+ * exponential when both alternatives start by parsing the same
+ * recursive rule at the same place.
+ */
+
+#ifndef __EBNF_ANALYSIS_HPP__
+#define __EBNF_ANALYSIS_HPP__
+
+#include "ebnf_sets.hpp"
+
+// How a match of an object can start, as far as it can be told from
+// the strings in the grammar
+struct ebnf_object_start {
+    bool        infallible; // always matches (a match of nothing, if nothing else)
+    bool        literal;    // matches exactly when the input starts with one of strings
+    bool        prefixed;   // every match starts with one of strings
+    set<string> strings;    // prefix free if literal
+
+    ebnf_object_start();
+};
+
+struct ebnf_finding {
+    enum kind_t { left_recursion, nullable_repetition, shadowed_alternative, first_overlap };
+
+    // Worst case extra work for an input of n bytes
+    enum cost_t {
+        constant,     // bounded, whatever the input
+        linear,       // part of the input is parsed again, once
+        polynomial,   // ... and that happens inside a loop
+        exponential,  // each level of nesting doubles the work
+        unbounded     // never finishes
+    };
+
+    kind_t kind;
+    cost_t cost;
+    string rule;      // the named rule it's in
+    string where;     // the object within the rule, like "alternative 2, item 1" ("" for the rule)
+    string message;
+
+    static const char *kind_name(kind_t kind);
+    static const char *cost_name(cost_t cost);
+};
+
+class ebnf_analysis {
+public:
+    // What the analysis knows about one reachable object
+    struct node {
+        enum kind_t { terminal, alternation, concatenation, exception, repetition, token, include, reference } kind;
+        string rule;              // named rule it's in
+        string where;             // within that rule
+        string name;              // rule name, reference name or quoted string, if any
+        string text;              // terminal
+        vector<size_t> parts;     // what it parses (on the same input), in order
+        vector<size_t> left;      // parts it can parse before consuming anything
+        ebnf_object_start start;
+        bool looped;              // in a repetition or a recursive rule
+        bool referenced;          // some reference resolves to it
+
+        node();
+    };
+private:
+    shared_ptr<ebnf_sets> object_sets;
+    unordered_map<const ebnf_object *, size_t> index;
+    vector<node> nodes;
+    vector<ebnf_finding> found;
+
+    ebnf_analysis();
+    size_t slot(const shared_ptr<ebnf_object> &object) const;
+    void connect();
+    void label(const ebnf_grammar &grammar);
+    void compute_starts(const vector<vector<size_t> > &components);
+    void compute_loops(const vector<vector<size_t> > &components);
+    bool reaches(const vector<size_t> &from, size_t target) const;
+    size_t resolve(size_t n) const;
+    vector<size_t> sequence(size_t n) const;
+    bool same(size_t a, size_t b) const;
+    string describe(const vector<size_t> &items, size_t i) const;
+
+    void find_left_recursion();
+    void find_nullable_repetitions();
+    void find_alternation_hazards();
+    void add(ebnf_finding::kind_t kind, ebnf_finding::cost_t cost, size_t object, const string &message);
+public:
+    static shared_ptr<ebnf_analysis> New(const ebnf_grammar &grammar);
+
+    // The nullable/FIRST/FOLLOW sets it was worked out from
+    const ebnf_sets &sets() const { return *object_sets; }
+
+    // Worst first
+    const vector<ebnf_finding> &findings() const { return found; }
+    ebnf_finding::cost_t worst() const; // constant if there's nothing to report
+};
+
+// A byte table as text, for reports:  "a-z _ \n"
+string ebnf_bytes_text(const bitset<256> &bytes);
+
+#endif // __EBNF_ANALYSIS_HPP__
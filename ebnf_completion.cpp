@@ -0,0 +1,375 @@
+#include <algorithm>
+#include <unordered_set>
+
+#include "ebnf_completion.hpp"
+
+//
+// ebnf_completions
+//
+
+ebnf_completions::ebnf_completions():complete(false) {}
+
+//
+// Compiles ebnf_objects into completer nodes
+//
+
+class ebnf_completion_compiler:public ebnf_visitor {
+    const unordered_map<const ebnf_object *, uint32_t> &index;
+    ebnf_completer::node &target;
+
+    uint32_t at(const shared_ptr<ebnf_object> &object) {
+        return index.at(object.get());
+    }
+public:
+    ebnf_completion_compiler(const unordered_map<const ebnf_object *, uint32_t> &_index,
+                             ebnf_completer::node &_target):index(_index), target(_target) {}
+
+    virtual void visit(ebnf_string &object) {
+        target.kind = ebnf_completer::node::literal;
+        target.text = object.text();
+    }
+
+    virtual void visit(ebnf_alternation &object) {
+        target.kind = ebnf_completer::node::rule;
+        for (auto &i:object.items()) {
+            target.productions.push_back(vector<uint32_t>(1, at(i)));
+        }
+    }
+
+    virtual void visit(ebnf_concatenation &object) {
+        target.kind = ebnf_completer::node::rule;
+        vector<uint32_t> production;
+        for (auto &i:object.items()) {
+            production.push_back(at(i));
+        }
+        target.productions.push_back(production);
+    }
+
+    // We can't express "but not" in the chart, so a left hand side
+    // is taken as is and a bare exception is one character that
+    // doesn't start the excluded part (see ebnf_sets).
+    virtual void visit(ebnf_exception &object) {
+        if (object.everything()) {
+            target.kind = ebnf_completer::node::rule;
+            target.productions.push_back(vector<uint32_t>(1, at(object.everything())));
+            return;
+        }
+        target.kind = ebnf_completer::node::byte_class;
+    }
+
+    // { x } is  r = () | r , x
+    // Left recursion keeps the chart flat; r = x , r would leave
+    // one item per repetition so far waiting to complete.
+    virtual void visit(ebnf_repetition &object) {
+        target.kind = ebnf_completer::node::rule;
+        target.productions.push_back(vector<uint32_t>());
+        if (object.item()) {
+            vector<uint32_t> production;
+            production.push_back(at(object.shared_from_this()));
+            production.push_back(at(object.item()));
+            target.productions.push_back(production);
+        }
+    }
+
+    // Completion works on characters, so look through to the rule
+    // the token was built from
+    virtual void visit(ebnf_token &object) {
+        target.kind = ebnf_completer::node::rule;
+        target.productions.push_back(vector<uint32_t>(1, at(object.source())));
+    }
+
+    // Only the name of the included file is typed here
+    virtual void visit(ebnf_include &object) {
+        target.kind = ebnf_completer::node::rule;
+        target.productions.push_back(vector<uint32_t>(1, at(object.path())));
+    }
+
+    // No productions at all if it isn't linked: it can't match
+    virtual void visit(ebnf_reference &object) {
+        target.kind = ebnf_completer::node::rule;
+        auto rule = object.rule();
+        if (rule) {
+            target.productions.push_back(vector<uint32_t>(1, at(rule)));
+        }
+    }
+};
+
+//
+// ebnf_completer
+//
+
+ebnf_completer::ebnf_completer():start(0) {
+}
+
+shared_ptr<ebnf_completer> ebnf_completer::New(const ebnf_grammar &grammar,
+                                               const string &start,
+                                               shared_ptr<ebnf_sets> sets) {
+    auto object = grammar.rule(start);
+    if (!object) {
+        return shared_ptr<ebnf_completer>();
+    }
+
+    auto rv = shared_ptr<ebnf_completer>(new ebnf_completer());
+    rv->start_object = object;
+    rv->sets = sets ? sets : ebnf_sets::New(grammar);
+    rv->compile();
+    rv->initial_set();
+    return rv;
+}
+
+void ebnf_completer::compile() {
+    auto &objects(sets->reachable());
+
+    unordered_map<const ebnf_object *, uint32_t> index;
+    for (uint32_t i=0; i<objects.size(); i++) {
+        index[objects[i].get()] = i;
+    }
+
+    nodes.resize(objects.size());
+    for (uint32_t i=0; i<objects.size(); i++) {
+        auto &n(nodes[i]);
+        auto &object_sets(sets->of(objects[i]));
+
+        ebnf_completion_compiler compiler(index, n);
+        objects[i]->accept(compiler);
+
+        n.key         = objects[i]->key;
+        n.nullable    = object_sets.nullable;
+        n.first_bytes = object_sets.first_bytes;
+        if (n.kind == node::byte_class) {
+            n.bytes = object_sets.first_bytes;
+        }
+    }
+
+    start = index.at(start_object.get());
+}
+
+void ebnf_completer::initial_set() {
+    chart.clear();
+    chart.push_back(chart_set());
+
+    auto &first(chart.back());
+    auto &n(nodes[start]);
+    if (n.kind == node::rule) {
+        for (uint32_t p=0; p<n.productions.size(); p++) {
+            item i = { start, p, 0, 0 };
+            first.items.push_back(i);
+        }
+    } else {
+        item i = { start, 0, 0, 0 };
+        first.items.push_back(i);
+    }
+    first.kernel = first.items.size();
+}
+
+// True if i is waiting on another node (rather than on a byte,
+// or being complete) and sets next to it
+
+bool ebnf_completer::next_node(const item &i, uint32_t &next) const {
+    auto &n(nodes[i.node]);
+    if (n.kind != node::rule) {
+        return false;
+    }
+    auto &production(n.productions[i.production]);
+    if (i.dot >= production.size()) {
+        return false;
+    }
+    next = production[i.dot];
+    return true;
+}
+
+static bool item_complete(const ebnf_completer::node &n, const ebnf_completer::item &i) {
+    switch (n.kind) {
+        case ebnf_completer::node::literal:
+            return i.dot == n.text.size();
+        case ebnf_completer::node::byte_class:
+            return i.dot == 1;
+        default:
+            return i.dot == n.productions[i.production].size();
+    }
+}
+
+// Earley predict/complete over one set.  lookahead is the next
+// input byte, or -1 if it isn't known yet.
+
+void ebnf_completer::close(chart_set &target, uint32_t offset, int lookahead) const {
+    unordered_set<item, item_hash> seen(target.items.begin(), target.items.end());
+    unordered_map<uint32_t, vector<uint32_t> > waiting_here;
+
+    auto add = [&](const item &i) {
+        if (seen.insert(i).second) {
+            target.items.push_back(i);
+        }
+    };
+    auto advance = [](item i) {
+        i.dot++;
+        return i;
+    };
+
+    for (size_t k=0; k<target.items.size(); k++) {
+        item current = target.items[k];
+        uint32_t next;
+
+        if (next_node(current, next)) {
+            waiting_here[next].push_back(k);
+
+            // Aycock & Horspool: step over anything that can be empty
+            // right away, rather than waiting for it to complete
+            auto &n(nodes[next]);
+            if (n.nullable) {
+                add(advance(current));
+            }
+            if ((lookahead >= 0) && !n.first_bytes.test(lookahead)) {
+                continue;
+            }
+            if (n.kind == node::rule) {
+                for (uint32_t p=0; p<n.productions.size(); p++) {
+                    item predicted = { next, p, 0, offset };
+                    add(predicted);
+                }
+            } else {
+                item predicted = { next, 0, 0, offset };
+                add(predicted);
+            }
+            continue;
+        }
+
+        if (!item_complete(nodes[current.node], current)) {
+            continue; // waiting on a byte
+        }
+
+        if (current.origin == offset) {
+            auto waiting = waiting_here.find(current.node);
+            if (waiting == waiting_here.end()) {
+                continue;
+            }
+            for (size_t w=0; w<waiting->second.size(); w++) {
+                add(advance(target.items[waiting->second[w]]));
+            }
+        } else {
+            auto &origin(chart[current.origin]);
+            auto range = equal_range(origin.waiting.begin(), origin.waiting.end(),
+                                     make_pair(current.node, (uint32_t)0),
+                                     [](const pair<uint32_t, uint32_t> &a,
+                                        const pair<uint32_t, uint32_t> &b) {
+                                         return a.first < b.first;
+                                     });
+            for (auto w=range.first; w!=range.second; w++) {
+                add(advance(origin.items[w->second]));
+            }
+        }
+    }
+
+    target.waiting.clear();
+    for (auto &i:waiting_here) {
+        for (auto k:i.second) {
+            target.waiting.push_back(make_pair(i.first, k));
+        }
+    }
+    sort(target.waiting.begin(), target.waiting.end());
+}
+
+bool ebnf_completer::scan(chart_set &from, unsigned char c, chart_set &to) const {
+    to.items.clear();
+    to.waiting.clear();
+
+    for (auto &i:from.items) {
+        auto &n(nodes[i.node]);
+        if (n.kind == node::literal) {
+            if ((i.dot < n.text.size()) && ((unsigned char)n.text[i.dot] == c)) {
+                item next = { i.node, 0, i.dot+1, i.origin };
+                to.items.push_back(next);
+            }
+        } else if (n.kind == node::byte_class) {
+            if ((i.dot == 0) && n.bytes.test(c)) {
+                item next = { i.node, 0, 1, i.origin };
+                to.items.push_back(next);
+            }
+        }
+    }
+    to.kernel = to.items.size();
+    return !to.items.empty();
+}
+
+// Forget a set's closure so it can be closed with a different lookahead
+
+void ebnf_completer::reopen(chart_set &target) const {
+    target.items.resize(target.kernel);
+    target.waiting.clear();
+}
+
+bool ebnf_completer::feed(char c) {
+    uint32_t offset = input.size();
+
+    close(chart.back(), offset, (unsigned char)c);
+
+    chart_set next;
+    if (!scan(chart.back(), c, next)) {
+        reopen(chart.back());
+        return false;
+    }
+
+    chart.push_back(next);
+    input += c;
+    return true;
+}
+
+bool ebnf_completer::feed(const string &text) {
+    for (auto c:text) {
+        if (!feed(c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ebnf_completer::rewind(size_t length) {
+    if (length >= input.size()) {
+        return;
+    }
+    chart.resize(length+1);
+    reopen(chart.back());
+    input.resize(length);
+}
+
+bool ebnf_completer::update(const string &text) {
+    size_t common = 0;
+    while ((common < input.size()) && (common < text.size()) && (input[common] == text[common])) {
+        common++;
+    }
+    rewind(common);
+    return feed(text.substr(common));
+}
+
+ebnf_completions ebnf_completer::completions() const {
+    ebnf_completions rv;
+    uint32_t offset = input.size();
+
+    chart_set here(chart.back());
+    close(here, offset, -1);
+
+    for (auto &i:here.items) {
+        auto &n(nodes[i.node]);
+
+        if ((i.dot == 0) && (i.origin == offset) && !n.key.empty()) {
+            rv.rules.insert(n.key);
+        }
+
+        if (n.kind == node::literal) {
+            if (i.dot < n.text.size()) {
+                rv.terminals.insert(n.text.substr(i.dot));
+                rv.bytes.set((unsigned char)n.text[i.dot]);
+            }
+        } else if (n.kind == node::byte_class) {
+            if (i.dot == 0) {
+                rv.bytes |= n.bytes;
+            }
+        }
+
+        if ((i.node == start) && (i.origin == 0) && item_complete(n, i)) {
+            rv.complete = true;
+        }
+    }
+
+    return rv;
+}
@@ -0,0 +1,120 @@
+/*
+ * Completion of partial input against an ebnf_grammar
+ *
+ * This is what drives "what can I type here?" for argv parsing,
+ * interactive CLI input and editor help.  Given a grammar, a start
+ * rule and the text typed so far, it reports the terminals and
+ * rules that are valid at the cursor.
+ *
+ * Unlike ebnf_object::parse this doesn't backtrack.  It keeps an
+ * Earley chart (one set of partially matched objects per input
+ * byte), so typing a character only computes one more set and a
+ * backspace just drops the last one.  Handing it the whole buffer
+ * again is cheap too: only the part after the common prefix is
+ * reparsed.  Left recursive rules (like rhs in ebnf_parser) are
+ * fine here.
+ *
+ * The nullable/FIRST sets from ebnf_sets keep the chart small:
+ * when the next byte is known only objects that can start with it
+ * are predicted, so a 52 way alternation of letters costs one item
+ * instead of 52.
+ */
+
+#ifndef __EBNF_COMPLETION_HPP__
+#define __EBNF_COMPLETION_HPP__
+
+#include <stdint.h>
+
+#include "ebnf_sets.hpp"
+
+struct ebnf_completions {
+    set<string> terminals;   // literal text that may be typed next (remainder if partly typed)
+    set<string> rules;       // named rules that may start at the cursor
+    bitset<256> bytes;       // every byte that may be typed next
+    bool        complete;    // the input so far is a full match of the start rule
+
+    ebnf_completions();
+};
+
+class ebnf_completer {
+public:
+    // Compiled form of one ebnf_object
+    struct node {
+        enum kind_t { literal, byte_class, rule } kind;
+        string key;                          // rule name if this object is a named rule
+        string text;                         // literal
+        bitset<256> bytes;                   // byte_class
+        vector<vector<uint32_t> > productions; // rule
+        bool nullable;
+        bitset<256> first_bytes;
+    };
+
+    struct item {
+        uint32_t node;       // index into nodes
+        uint32_t production; // which production of the node
+        uint32_t dot;        // how much of it has been matched
+        uint32_t origin;     // input offset the match started at
+
+        bool operator==(const item &other) const {
+            return node==other.node && production==other.production &&
+                   dot==other.dot && origin==other.origin;
+        }
+    };
+
+    struct item_hash {
+        size_t operator()(const item &i) const {
+            return ((size_t)i.node * 1000003u) ^ ((size_t)i.production * 8191u) ^
+                   ((size_t)i.dot * 131u) ^ ((size_t)i.origin << 20);
+        }
+    };
+
+    struct chart_set {
+        vector<item> items;
+        size_t kernel;                                // items that came from scanning
+        vector<pair<uint32_t, uint32_t> > waiting;    // (node, item) sorted, once closed
+    };
+
+private:
+    shared_ptr<ebnf_object> start_object;
+    shared_ptr<ebnf_sets> sets;
+    vector<node> nodes;
+    uint32_t start;
+    string input;
+    vector<chart_set> chart; // chart[i] is the state after input[0..i)
+
+    ebnf_completer();
+    void compile();
+    void initial_set();
+    void close(chart_set &target, uint32_t offset, int lookahead) const;
+    bool scan(chart_set &from, unsigned char c, chart_set &to) const;
+    void reopen(chart_set &target) const;
+    bool next_node(const item &i, uint32_t &next) const;
+
+public:
+    // Returns an empty pointer if start isn't a rule in the grammar.
+    // sets may be shared between completers on the same grammar.
+    static shared_ptr<ebnf_completer> New(const ebnf_grammar &grammar,
+                                          const string &start,
+                                          shared_ptr<ebnf_sets> sets=shared_ptr<ebnf_sets>());
+
+    // Append to the input.  Stops at the first byte that can't be
+    // part of a valid input and returns false (the state is left at
+    // the longest valid prefix).
+    bool feed(const string &text);
+    bool feed(char c);
+
+    // Drop the input back to length bytes
+    void rewind(size_t length);
+
+    // Make the input equal to text, reparsing only past the common prefix
+    bool update(const string &text);
+
+    // The accepted (valid prefix of the) input
+    const string &text() const { return input; }
+    size_t length() const { return input.size(); }
+
+    // What may come next at the end of the accepted input
+    ebnf_completions completions() const;
+};
+
+#endif // __EBNF_COMPLETION_HPP__
@@ -0,0 +1,324 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ebnf_disk_cache.hpp"
+#include "ebnf_include.hpp" // for ebnf_parse_cache::content_hash
+
+// Bump whenever the layout below changes
+static const uint32_t disk_cache_version = 3;
+static const char disk_cache_magic[8] = { 'S', 'C', 'I', 'P', 'A', 'R', 'S', 'E' };
+static const uint32_t disk_cache_no_owner = 0xffffffff;
+
+struct disk_cache_header {
+    char     magic[8];
+    uint32_t version;
+    int32_t  result;       // what parse_file returned
+    uint64_t grammar;      // ebnf_grammar::fingerprint
+    uint64_t rule;         // ebnf_hash of the start rule
+    uint64_t content;      // ebnf_parse_cache::content_hash of the file
+    uint64_t lexer;        // config_file::lexer of the file
+    uint64_t records;      // ebnf_hash of the node records
+    uint32_t file_size;
+    uint32_t objects;      // objects in the grammar
+    uint32_t nodes;        // node records that follow
+    uint32_t tokenized;    // config_file::tokenized of the file
+};
+
+// One parse_tree, followed by its children's records
+struct disk_cache_node {
+    uint32_t owner;        // object number, or disk_cache_no_owner
+    uint32_t start;        // byte offset the match starts at
+    uint32_t byte_offset;  // end point
+    uint32_t line_number;
+    uint32_t line_offset;
+    uint32_t children;
+};
+
+ebnf_disk_cache::ebnf_disk_cache(const string &_directory):directory(_directory),
+                                                           numbered(0),
+                                                           _hits(0),
+                                                           _misses(0),
+                                                           _stores(0),
+                                                           _rejected(0) {
+    mkdir(directory.c_str(), 0755); // fine if it's already there
+}
+
+shared_ptr<ebnf_disk_cache> ebnf_disk_cache::New(const string &directory) {
+    return shared_ptr<ebnf_disk_cache>(new ebnf_disk_cache(directory));
+}
+
+// Number the grammar's objects in depth first order from the rules
+// (in key order), the same for any grammar with this fingerprint
+
+void ebnf_disk_cache::number(const ebnf_grammar &grammar, uint64_t fingerprint) {
+    auto &rules(grammar.rules());
+    if ((numbered == fingerprint) && !objects.empty() &&
+        !rules.empty() && (objects[0] == rules.begin()->second)) {
+        return; // same grammar as last time
+    }
+
+    objects.clear();
+    numbers.clear();
+
+    vector<shared_ptr<ebnf_object> > pending;
+    for (auto i=rules.rbegin(); i!=rules.rend(); i++) {
+        pending.push_back(i->second);
+    }
+    while (!pending.empty()) {
+        auto object = pending.back();
+        pending.pop_back();
+        if (!object || numbers.count(object.get())) {
+            continue;
+        }
+        numbers[object.get()] = objects.size();
+        objects.push_back(object);
+
+        ebnf_children children;
+        object->accept(children);
+        pending.insert(pending.end(), children.children.rbegin(), children.children.rend());
+    }
+    numbered = fingerprint;
+}
+
+string ebnf_disk_cache::entry(uint64_t fingerprint, const string &rule,
+                              config_file &file, uint64_t content) const {
+    uint32_t tokenized = file.tokenized();
+    uint64_t lexer = file.lexer();
+
+    uint64_t hash = ebnf_hash(&fingerprint, sizeof(fingerprint));
+    hash = ebnf_hash(rule, hash);
+    hash = ebnf_hash(&content, sizeof(content), hash);
+    hash = ebnf_hash(&tokenized, sizeof(tokenized), hash);
+    hash = ebnf_hash(&lexer, sizeof(lexer), hash);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.tree", (unsigned long long)hash);
+    return directory + "/" + name;
+}
+
+int ebnf_disk_cache::load(const ebnf_grammar &grammar, uint64_t fingerprint,
+                          const string &rule, parse_tree &tree, ebnf_budget &budget) {
+    auto file = tree.end.file;
+    if (!file || tree.end.byte_offset || !tree.children.empty()) {
+        return -1;
+    }
+    uint64_t content = ebnf_parse_cache::content_hash(*file);
+
+    int fd = open(entry(fingerprint, rule, *file, content).c_str(), O_RDONLY);
+    if (fd < 0) {
+        _misses++;
+        return -1;
+    }
+
+    struct stat info;
+    void *mapped = MAP_FAILED;
+    if ((fstat(fd, &info) == 0) && ((size_t)info.st_size >= sizeof(disk_cache_header))) {
+        mapped = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        _rejected++;
+        return -1;
+    }
+
+    number(grammar, fingerprint);
+
+    const disk_cache_header &header(*(const disk_cache_header *)mapped);
+    const disk_cache_node *nodes = (const disk_cache_node *)(&header + 1);
+    size_t size = info.st_size;
+
+    bool ok = (memcmp(header.magic, disk_cache_magic, sizeof(header.magic)) == 0) &&
+              (header.version == disk_cache_version) &&
+              ((header.result == 0) || (header.result == -2)) &&
+              (header.grammar == fingerprint) &&
+              (header.rule == ebnf_hash(rule)) &&
+              (header.content == content) &&
+              (header.tokenized == (uint32_t)file->tokenized()) &&
+              (header.lexer == file->lexer()) &&
+              (header.file_size == file->size()) &&
+              (header.objects == objects.size()) &&
+              (header.nodes >= 1) &&
+              (size == sizeof(header) + (size_t)header.nodes * sizeof(disk_cache_node)) &&
+              (header.records == ebnf_hash(nodes, (size_t)header.nodes * sizeof(disk_cache_node)));
+
+    // The root is tree itself, which the caller already has
+    if (ok && !budget.add_nodes(header.nodes - 1)) {
+        munmap(mapped, size);
+        _hits++;
+        return -3;
+    }
+
+    // Rebuild into a spare tree, so a bad entry leaves tree alone
+    parse_tree rebuilt(tree.owner, tree.end);
+    if (ok) {
+        struct building {
+            parse_tree *tree;
+            uint32_t children; // still to add
+        };
+        vector<building> stack;
+        uint32_t next = 0;
+
+        auto fill = [&](parse_tree &t, const disk_cache_node &n) {
+            if ((n.start > n.byte_offset) || (n.byte_offset > header.file_size) ||
+                ((n.owner != disk_cache_no_owner) && (n.owner >= objects.size())) ||
+                (n.children > header.nodes - next)) {
+                return false;
+            }
+            if (n.owner != disk_cache_no_owner) {
+                t.owner = objects[n.owner];
+            }
+            t.start = n.start;
+            t.end.byte_offset = n.byte_offset;
+            t.end.line_number = n.line_number;
+            t.end.line_offset = n.line_offset;
+            t.children.reserve(n.children);
+            return true;
+        };
+
+        const disk_cache_node &root(nodes[next++]);
+        ok = fill(rebuilt, root);
+        stack.push_back({ &rebuilt, root.children });
+        while (ok && !stack.empty()) {
+            auto &top(stack.back());
+            if (!top.children) {
+                stack.pop_back();
+                continue;
+            }
+            if (next >= header.nodes) {
+                ok = false;
+                break;
+            }
+            top.children--;
+            top.tree->children.push_back(parse_tree(shared_ptr<ebnf_object>(), tree.end));
+            parse_tree &child(top.tree->children.back());
+            const disk_cache_node &n(nodes[next++]);
+            ok = fill(child, n);
+            stack.push_back({ &child, n.children });
+        }
+        ok = ok && (next == header.nodes);
+    }
+
+    int result = header.result;
+    munmap(mapped, size);
+
+    if (!ok) {
+        _rejected++;
+        return -1;
+    }
+
+    tree.owner = rebuilt.owner;
+    tree.start = rebuilt.start;
+    tree.end   = rebuilt.end;
+    tree.children.swap(rebuilt.children);
+    _hits++;
+    return result;
+}
+
+bool ebnf_disk_cache::store(const ebnf_grammar &grammar, uint64_t fingerprint,
+                            const string &rule, const parse_tree &tree, int result) {
+    auto file = tree.end.file;
+    if (!file || ((result != 0) && (result != -2))) {
+        return false;
+    }
+
+    number(grammar, fingerprint);
+
+    // Flatten in preorder
+    vector<disk_cache_node> nodes;
+    vector<const parse_tree *> pending(1, &tree);
+    while (!pending.empty()) {
+        const parse_tree *t = pending.back();
+        pending.pop_back();
+
+        if (t->included || (t->end.file != file)) {
+            return false; // depends on more than this file
+        }
+
+        disk_cache_node n;
+        n.owner = disk_cache_no_owner;
+        if (t->owner) {
+            auto found = numbers.find(t->owner.get());
+            if (found == numbers.end()) {
+                return false; // not part of this grammar
+            }
+            n.owner = found->second;
+        }
+        n.start       = t->start;
+        n.byte_offset = t->end.byte_offset;
+        n.line_number = t->end.line_number;
+        n.line_offset = t->end.line_offset;
+        n.children    = t->children.size();
+        nodes.push_back(n);
+
+        for (auto i=t->children.rbegin(); i!=t->children.rend(); i++) {
+            pending.push_back(&*i);
+        }
+    }
+
+    disk_cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, disk_cache_magic, sizeof(header.magic));
+    header.version   = disk_cache_version;
+    header.result    = result;
+    header.grammar   = fingerprint;
+    header.rule      = ebnf_hash(rule);
+    header.content   = ebnf_parse_cache::content_hash(*file);
+    header.lexer     = file->lexer();
+    header.records   = ebnf_hash(nodes.data(), nodes.size() * sizeof(disk_cache_node));
+    header.file_size = file->size();
+    header.objects   = objects.size();
+    header.nodes     = nodes.size();
+    header.tokenized = file->tokenized();
+
+    // A name no other writer can have, even one in another pid
+    // namespace sharing the directory
+    string path = entry(fingerprint, rule, *file, header.content);
+    vector<char> temporary(path.begin(), path.end());
+    const char suffix[] = ".tmp.XXXXXX";
+    temporary.insert(temporary.end(), suffix, suffix + sizeof(suffix));
+
+    int fd = mkstemp(temporary.data());
+    if (fd < 0) {
+        return false;
+    }
+    fchmod(fd, 0644); // mkstemp makes it private
+
+    struct piece {
+        const char *data;
+        size_t length;
+    } pieces[] = {
+        { (const char *)&header, sizeof(header) },
+        { (const char *)nodes.data(), nodes.size() * sizeof(disk_cache_node) }
+    };
+
+    bool ok = true;
+    for (auto &p:pieces) {
+        while (ok && p.length) {
+            ssize_t written = write(fd, p.data, p.length);
+            if (written < 0) {
+                ok = (errno == EINTR);
+                continue;
+            }
+            p.data   += written;
+            p.length -= written;
+        }
+    }
+    // On disk before it has its real name, or a crash could leave a
+    // named but empty entry
+    ok = ok && (fsync(fd) == 0);
+    ok = (close(fd) == 0) && ok;
+    ok = ok && (rename(temporary.data(), path.c_str()) == 0);
+
+    if (!ok) {
+        unlink(temporary.data());
+        return false;
+    }
+    _stores++;
+    return true;
+}
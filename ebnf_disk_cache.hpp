@@ -0,0 +1,69 @@
+/*
+ * Keeping finished parses on disk between runs
+ *
+ * Lots of short lived jobs parse the same unchanged configs every
+ * time they start.  An ebnf_disk_cache, set on a grammar with
+ * ebnf_grammar::set_disk_cache, keeps each parse_file result in a
+ * directory, keyed by the grammar's fingerprint, the start rule, a
+ * hash of the file's contents and how it was tokenized (the same
+ * text cut up by another ebnf_lexer can parse differently), and
+ * parse_file maps and checks the stored tree instead of parsing
+ * again.  A loaded tree is charged to the budget's node and byte
+ * limits as if it had been parsed.
+ *
+ * An entry is one flat file: a fixed header, then the tree's nodes
+ * in preorder as fixed size records.  Owners are stored as numbers
+ * (the order a depth first walk of the grammar finds them, which
+ * the fingerprint pins down) and spans as offsets into the parsed
+ * file.  Loading maps the entry, checks the header and a hash of
+ * the records, and rebuilds the parse_tree in one pass.
+ *
+ * Entries are written to a unique temporary file and renamed into place,
+ * so a reader sees a whole entry or none at all, however many jobs
+ * share the directory.  Trees with included files aren't stored:
+ * the key doesn't cover the included files' contents.
+ */
+
+#ifndef __EBNF_DISK_CACHE_HPP__
+#define __EBNF_DISK_CACHE_HPP__
+
+#include <unordered_map>
+#include <stdint.h>
+
+#include "ebnf.hpp"
+
+class ebnf_disk_cache {
+    string directory;
+
+    // grammar objects by number, for the grammar last seen
+    uint64_t numbered;
+    vector<shared_ptr<ebnf_object> > objects;
+    unordered_map<const ebnf_object *, uint32_t> numbers;
+
+    unsigned long _hits, _misses, _stores, _rejected;
+
+    ebnf_disk_cache(const string &directory);
+    void number(const ebnf_grammar &grammar, uint64_t fingerprint);
+    string entry(uint64_t fingerprint, const string &rule, config_file &file, uint64_t content) const;
+public:
+    static shared_ptr<ebnf_disk_cache> New(const string &directory);
+
+    // The stored parse_file result (0 or -2) with tree filled in, -3
+    // if the stored tree is over budget's limits (tree is left alone),
+    // or -1 if there's no usable entry.  tree must be unparsed and
+    // start at the beginning of its file.
+    int load(const ebnf_grammar &grammar, uint64_t fingerprint,
+             const string &rule, parse_tree &tree, ebnf_budget &budget);
+
+    // Store a parse_file result.  Returns false if it wasn't stored
+    // (can't be, or the write failed).
+    bool store(const ebnf_grammar &grammar, uint64_t fingerprint,
+               const string &rule, const parse_tree &tree, int result);
+
+    unsigned long hits() const { return _hits; }
+    unsigned long misses() const { return _misses; }
+    unsigned long stores() const { return _stores; }
+    unsigned long rejected() const { return _rejected; } // entries that failed the checks
+};
+
+#endif // __EBNF_DISK_CACHE_HPP__
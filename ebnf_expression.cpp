@@ -0,0 +1,1208 @@
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ebnf_expression.hpp"
+
+//
+// ebnf_expression_grammar
+//
+
+static void add_range(shared_ptr<ebnf_group> target, char first, char last) {
+    for (char c=first; c<=last; c++) {
+        target->add(ebnf_string::New(string(1, c)));
+    }
+}
+
+static shared_ptr<ebnf_alternation> one_of(const char *elements) {
+    auto rv = ebnf_alternation::New();
+    for (const char *c=elements; *c; c++) {
+        rv->add(ebnf_string::New(string(1, *c)));
+    }
+    return rv;
+}
+
+ebnf_expression_grammar::ebnf_expression_grammar() {
+    auto letter = ebnf_alternation::New();
+    add_range(letter, 'a', 'z');
+    add_range(letter, 'A', 'Z');
+    *letter << ebnf_string::New("_")
+            << ebnf_string::New("\xc2\xb5")  // µ
+            << ebnf_string::New("\xce\xa9"); // Ω
+    add("letter", letter);
+
+    auto digit = ebnf_alternation::New();
+    add_range(digit, '0', '9');
+    add("digit", digit);
+
+    auto digits = ebnf_concatenation::New();
+    *digits << digit << ebnf_repetition::New(digit);
+    add("digits", digits);
+
+    auto space = ebnf_repetition::New(one_of(" \t\r\n"));
+    add("space", space);
+
+    auto inline_space = ebnf_repetition::New(one_of(" \t"));
+    add("inline", inline_space);
+
+    auto name_character = ebnf_alternation::New();
+    *name_character << letter << digit;
+    auto name = ebnf_concatenation::New();
+    *name << letter << ebnf_repetition::New(name_character);
+    add("name", name);
+
+    // number
+
+    auto fraction = ebnf_concatenation::New();
+    *fraction << ebnf_string::New(".") << digits;
+    auto exponent = ebnf_concatenation::New();
+    *exponent << one_of("eE") << ebnf_repetition::New(one_of("+-")) << digits;
+    auto number = ebnf_concatenation::New();
+    *number << digits << ebnf_repetition::New(fraction) << ebnf_repetition::New(exponent);
+    add("number", number);
+
+    auto integer = ebnf_concatenation::New();
+    *integer << ebnf_repetition::New(ebnf_string::New("-")) << digits;
+    add("integer", integer);
+
+    // Everything that nests goes back to expression by name
+
+    auto expression_reference = ebnf_reference::New("expression");
+
+    auto call = ebnf_concatenation::New();
+    *call << name << inline_space << ebnf_string::New("(") << space
+          << expression_reference << space << ebnf_string::New(")");
+    add("call", call);
+
+    auto group = ebnf_concatenation::New();
+    *group << ebnf_string::New("(") << space << expression_reference << space << ebnf_string::New(")");
+    add("group", group);
+
+    auto more_elements = ebnf_concatenation::New();
+    *more_elements << ebnf_string::New(",") << space << expression_reference << space;
+    auto elements = ebnf_concatenation::New();
+    *elements << expression_reference << space << ebnf_repetition::New(more_elements);
+    auto array = ebnf_concatenation::New();
+    *array << ebnf_string::New("[") << space << ebnf_repetition::New(elements) << ebnf_string::New("]");
+    add("array", array);
+
+    auto primary = ebnf_alternation::New();
+    *primary << number << call << name << group << array;
+    add("primary", primary);
+
+    auto raised = ebnf_concatenation::New();
+    *raised << inline_space << ebnf_string::New("^") << space << integer;
+    auto power = ebnf_concatenation::New();
+    *power << primary << ebnf_repetition::New(raised);
+    add("power", power);
+
+    auto sign = ebnf_concatenation::New();
+    *sign << one_of("-+") << space;
+    auto unary = ebnf_concatenation::New();
+    *unary << ebnf_repetition::New(sign) << power;
+    add("unary", unary);
+
+    auto times = ebnf_concatenation::New();
+    *times << inline_space << one_of("*/") << space << unary;
+    auto juxtaposed = ebnf_concatenation::New();
+    *juxtaposed << inline_space << power;
+    auto factor = ebnf_alternation::New();
+    *factor << times << juxtaposed;
+    auto product = ebnf_concatenation::New();
+    *product << unary << ebnf_repetition::New(factor);
+    add("product", product);
+
+    auto plus = ebnf_concatenation::New();
+    *plus << inline_space << one_of("+-") << space << product;
+    auto expression = ebnf_concatenation::New();
+    *expression << product << ebnf_repetition::New(plus);
+    add("expression", expression);
+
+    // Where expressions are used
+
+    auto formula = ebnf_concatenation::New();
+    *formula << space << expression << space;
+    add("formula", formula);
+
+    auto definition = ebnf_concatenation::New();
+    *definition << name << inline_space << ebnf_string::New("=") << space
+                << expression << inline_space << ebnf_repetition::New(ebnf_string::New(";"));
+    add("definition", definition);
+
+    auto spaced_definition = ebnf_concatenation::New();
+    *spaced_definition << definition << space;
+    auto definitions = ebnf_concatenation::New();
+    *definitions << space << ebnf_repetition::New(spaced_definition);
+    add("definitions", definitions);
+
+    link();
+}
+
+//
+// ebnf_dimension
+//
+
+static const char *base_symbols[ebnf_dimension::bases] = { "m", "kg", "s", "A", "K", "mol", "cd" };
+
+ebnf_dimension::ebnf_dimension() {
+    for (int i=0; i<bases; i++) {
+        power[i] = 0;
+    }
+}
+
+bool ebnf_dimension::operator==(const ebnf_dimension &other) const {
+    for (int i=0; i<bases; i++) {
+        if (power[i] != other.power[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool fits(int power) {
+    return (power >= -128) && (power <= 127);
+}
+
+bool ebnf_dimension::times(const ebnf_dimension &other, int sign, ebnf_dimension &result) const {
+    for (int i=0; i<bases; i++) {
+        int p = power[i] + sign * other.power[i];
+        if (!fits(p)) {
+            return false;
+        }
+        result.power[i] = p;
+    }
+    return true;
+}
+
+bool ebnf_dimension::raised(int n, ebnf_dimension &result) const {
+    for (int i=0; i<bases; i++) {
+        int p = power[i] * n;
+        if (!fits(p)) {
+            return false;
+        }
+        result.power[i] = p;
+    }
+    return true;
+}
+
+bool ebnf_dimension::root(int n, ebnf_dimension &result) const {
+    for (int i=0; i<bases; i++) {
+        if (power[i] % n) {
+            return false;
+        }
+        result.power[i] = power[i] / n;
+    }
+    return true;
+}
+
+bool ebnf_dimension::dimensionless() const {
+    return *this == ebnf_dimension();
+}
+
+string ebnf_dimension::text() const {
+    string rv;
+    for (int i=0; i<bases; i++) {
+        if (!power[i]) {
+            continue;
+        }
+        if (!rv.empty()) {
+            rv += " ";
+        }
+        rv += base_symbols[i];
+        if (power[i] != 1) {
+            rv += "^" + to_string(power[i]);
+        }
+    }
+    return rv.empty() ? "1" : rv;
+}
+
+string ebnf_type::text() const {
+    if (array) {
+        return "[" + to_string(length) + "] " + dimension.text();
+    }
+    return dimension.text();
+}
+
+string ebnf_value::text() const {
+    string rv;
+    char number[32];
+    if (array) {
+        rv = "[";
+    }
+    for (size_t i=0; i<data.size(); i++) {
+        snprintf(number, sizeof(number), "%g", data[i]);
+        rv += (i ? ", " : "") + string(number);
+    }
+    if (array) {
+        rv += "]";
+    }
+    if (!dimension.dimensionless()) {
+        rv += " " + dimension.text();
+    }
+    return rv;
+}
+
+ebnf_instruction::ebnf_instruction():code(constant), a(0), b(0), count(0), exponent(0), function(0) {
+}
+
+//
+// Units
+//
+
+struct ebnf_unit {
+    const char *name;
+    double scale;
+    int8_t power[ebnf_dimension::bases]; // m kg s A K mol cd
+    bool prefixed;                       // can take an SI prefix
+};
+
+static const ebnf_unit units[] = {
+    { "m",    1,       { 1, 0, 0, 0, 0, 0, 0 },  true },
+    { "g",    1e-3,    { 0, 1, 0, 0, 0, 0, 0 },  true },
+    { "s",    1,       { 0, 0, 1, 0, 0, 0, 0 },  true },
+    { "A",    1,       { 0, 0, 0, 1, 0, 0, 0 },  true },
+    { "K",    1,       { 0, 0, 0, 0, 1, 0, 0 },  true },
+    { "mol",  1,       { 0, 0, 0, 0, 0, 1, 0 },  true },
+    { "cd",   1,       { 0, 0, 0, 0, 0, 0, 1 },  true },
+    { "Hz",   1,       { 0, 0, -1, 0, 0, 0, 0 }, true },
+    { "N",    1,       { 1, 1, -2, 0, 0, 0, 0 }, true },
+    { "Pa",   1,       { -1, 1, -2, 0, 0, 0, 0 }, true },
+    { "J",    1,       { 2, 1, -2, 0, 0, 0, 0 }, true },
+    { "W",    1,       { 2, 1, -3, 0, 0, 0, 0 }, true },
+    { "C",    1,       { 0, 0, 1, 1, 0, 0, 0 },  true },
+    { "V",    1,       { 2, 1, -3, -1, 0, 0, 0 }, true },
+    { "ohm",  1,       { 2, 1, -3, -2, 0, 0, 0 }, true },
+    { "\xce\xa9", 1,   { 2, 1, -3, -2, 0, 0, 0 }, true },
+    { "F",    1,       { -2, -1, 4, 2, 0, 0, 0 }, true },
+    { "T",    1,       { 0, 1, -2, -1, 0, 0, 0 }, true },
+    { "L",    1e-3,    { 3, 0, 0, 0, 0, 0, 0 },  true },
+    { "eV",   1.602176634e-19, { 2, 1, -2, 0, 0, 0, 0 }, true },
+    { "min",  60,      { 0, 0, 1, 0, 0, 0, 0 },  false },
+    { "h",    3600,    { 0, 0, 1, 0, 0, 0, 0 },  false },
+    { "day",  86400,   { 0, 0, 1, 0, 0, 0, 0 },  false },
+    { "rad",  1,       { 0, 0, 0, 0, 0, 0, 0 },  false },
+    { "deg",  M_PI / 180, { 0, 0, 0, 0, 0, 0, 0 }, false },
+    { "pi",   M_PI,    { 0, 0, 0, 0, 0, 0, 0 },  false },
+};
+
+static const struct {
+    const char *name;
+    double scale;
+} prefixes[] = {
+    { "Y", 1e24 }, { "Z", 1e21 }, { "E", 1e18 }, { "P", 1e15 }, { "T", 1e12 },
+    { "G", 1e9 },  { "M", 1e6 },  { "k", 1e3 },  { "h", 1e2 },  { "da", 1e1 },
+    { "d", 1e-1 }, { "c", 1e-2 }, { "m", 1e-3 }, { "u", 1e-6 }, { "\xc2\xb5", 1e-6 },
+    { "n", 1e-9 }, { "p", 1e-12 }, { "f", 1e-15 }, { "a", 1e-18 },
+};
+
+static const ebnf_unit *find_unit(const string &name) {
+    for (auto &i:units) {
+        if (name == i.name) {
+            return &i;
+        }
+    }
+    return 0;
+}
+
+// Units without a prefix win, so "min" is minutes rather than
+// milli-inches and "cd" candela rather than centi-days
+static bool unit_value(const string &name, ebnf_value &value) {
+    double scale = 1;
+    const ebnf_unit *unit = find_unit(name);
+    if (!unit) {
+        for (auto &i:prefixes) {
+            string prefix(i.name);
+            if ((name.size() > prefix.size()) && (name.compare(0, prefix.size(), prefix) == 0)) {
+                unit = find_unit(name.substr(prefix.size()));
+                if (unit && unit->prefixed) {
+                    scale = i.scale;
+                    break;
+                }
+                unit = 0;
+            }
+        }
+    }
+    if (!unit) {
+        return false;
+    }
+    value = ebnf_value();
+    for (int i=0; i<ebnf_dimension::bases; i++) {
+        value.dimension.power[i] = unit->power[i];
+    }
+    value.data.assign(1, unit->scale * scale);
+    return true;
+}
+
+//
+// Functions
+//
+
+enum ebnf_function { function_sqrt, function_abs, function_exp, function_log, function_sin, function_cos, function_sum, functions };
+
+static const char *function_names[functions] = { "sqrt", "abs", "exp", "log", "sin", "cos", "sum" };
+
+//
+// Kernels
+//
+// Straight loops over contiguous doubles, with restrict so the
+// vectorizer (-O3) doesn't have to allow for aliasing.  Scalars are
+// broadcast.
+//
+
+struct negate_f   { double operator()(double x) const { return -x; } };
+struct sqrt_f     { double operator()(double x) const { return sqrt(x); } };
+struct abs_f      { double operator()(double x) const { return fabs(x); } };
+struct exp_f      { double operator()(double x) const { return exp(x); } };
+struct log_f      { double operator()(double x) const { return log(x); } };
+struct sin_f      { double operator()(double x) const { return sin(x); } };
+struct cos_f      { double operator()(double x) const { return cos(x); } };
+struct power_f    { int n; double operator()(double x) const { return pow(x, n); } };
+struct add_f      { double operator()(double x, double y) const { return x + y; } };
+struct subtract_f { double operator()(double x, double y) const { return x - y; } };
+struct multiply_f { double operator()(double x, double y) const { return x * y; } };
+struct divide_f   { double operator()(double x, double y) const { return x / y; } };
+
+template <class F> static void map_loop(double *__restrict o, const double *__restrict x, size_t n, F f) {
+    for (size_t i=0; i<n; i++) {
+        o[i] = f(x[i]);
+    }
+}
+
+template <class F> static void zip_loop(double *__restrict o, const double *__restrict x,
+                                        const double *__restrict y, size_t n, F f) {
+    for (size_t i=0; i<n; i++) {
+        o[i] = f(x[i], y[i]);
+    }
+}
+
+template <class F> static void left_loop(double *__restrict o, double s, const double *__restrict y, size_t n, F f) {
+    for (size_t i=0; i<n; i++) {
+        o[i] = f(s, y[i]);
+    }
+}
+
+template <class F> static void right_loop(double *__restrict o, const double *__restrict x, double s, size_t n, F f) {
+    for (size_t i=0; i<n; i++) {
+        o[i] = f(x[i], s);
+    }
+}
+
+template <class F> static void unary_kernel(const ebnf_value &a, ebnf_value &out, F f) {
+    out.data.resize(a.data.size());
+    map_loop(out.data.data(), a.data.data(), a.data.size(), f);
+}
+
+template <class F> static void binary_kernel(const ebnf_value &a, const ebnf_value &b, ebnf_value &out, F f) {
+    size_t n = a.array ? a.data.size() : b.data.size();
+    out.data.resize(n);
+    if (a.array == b.array) {
+        zip_loop(out.data.data(), a.data.data(), b.data.data(), n, f);
+    } else if (!a.array) {
+        left_loop(out.data.data(), a.data[0], b.data.data(), n, f);
+    } else {
+        right_loop(out.data.data(), a.data.data(), b.data[0], n, f);
+    }
+}
+
+// Run one instruction (not constant or load) on its operands' values
+
+static void apply(const ebnf_instruction &op, const ebnf_value *const *operands, ebnf_value &out) {
+    static_cast<ebnf_type &>(out) = op.type;
+
+    const ebnf_value &a(*operands[0]);
+    switch (op.code) {
+        case ebnf_instruction::constant:
+        case ebnf_instruction::load:
+            break;
+        case ebnf_instruction::pack:
+            out.data.resize(op.count);
+            for (uint32_t i=0; i<op.count; i++) {
+                out.data[i] = operands[i]->number();
+            }
+            break;
+        case ebnf_instruction::negate:   unary_kernel(a, out, negate_f()); break;
+        case ebnf_instruction::add:      binary_kernel(a, *operands[1], out, add_f()); break;
+        case ebnf_instruction::subtract: binary_kernel(a, *operands[1], out, subtract_f()); break;
+        case ebnf_instruction::multiply: binary_kernel(a, *operands[1], out, multiply_f()); break;
+        case ebnf_instruction::divide:   binary_kernel(a, *operands[1], out, divide_f()); break;
+        case ebnf_instruction::power: {
+            power_f f = { op.exponent };
+            unary_kernel(a, out, f);
+            break;
+        }
+        case ebnf_instruction::call:
+            switch (op.function) {
+                case function_sqrt: unary_kernel(a, out, sqrt_f()); break;
+                case function_abs:  unary_kernel(a, out, abs_f()); break;
+                case function_exp:  unary_kernel(a, out, exp_f()); break;
+                case function_log:  unary_kernel(a, out, log_f()); break;
+                case function_sin:  unary_kernel(a, out, sin_f()); break;
+                case function_cos:  unary_kernel(a, out, cos_f()); break;
+                case function_sum: {
+                    double total = 0;
+                    for (auto i:a.data) {
+                        total += i;
+                    }
+                    out.data.assign(1, total);
+                    break;
+                }
+            }
+            break;
+    }
+}
+
+// The type op produces from its operands' types, or false with why
+
+static bool result_type(ebnf_instruction &op, const ebnf_type &a, const ebnf_type *b, string &why) {
+    op.type = a;
+    switch (op.code) {
+        case ebnf_instruction::constant:
+        case ebnf_instruction::load:
+        case ebnf_instruction::pack:
+        case ebnf_instruction::negate:
+            return true;
+
+        case ebnf_instruction::add:
+        case ebnf_instruction::subtract:
+        case ebnf_instruction::multiply:
+        case ebnf_instruction::divide:
+            if (a.array && b->array && (a.length != b->length)) {
+                why = "arrays of different lengths (" + to_string(a.length) + " and " + to_string(b->length) + ")";
+                return false;
+            }
+            if (b->array) {
+                op.type.array  = true;
+                op.type.length = b->length;
+            }
+            if ((op.code == ebnf_instruction::add) || (op.code == ebnf_instruction::subtract)) {
+                if (a.dimension != b->dimension) {
+                    why = string("can't ") + ((op.code == ebnf_instruction::add) ? "add " : "subtract ") +
+                          a.dimension.text() + " and " + b->dimension.text();
+                    return false;
+                }
+                return true;
+            }
+            if (!a.dimension.times(b->dimension, (op.code == ebnf_instruction::multiply) ? 1 : -1, op.type.dimension)) {
+                why = "units out of range";
+                return false;
+            }
+            return true;
+
+        case ebnf_instruction::power:
+            if (!a.dimension.raised(op.exponent, op.type.dimension)) {
+                why = "units out of range";
+                return false;
+            }
+            return true;
+
+        case ebnf_instruction::call:
+            switch (op.function) {
+                case function_sqrt:
+                    if (!a.dimension.root(2, op.type.dimension)) {
+                        why = "can't take the square root of " + a.dimension.text();
+                        return false;
+                    }
+                    return true;
+                case function_abs:
+                    return true;
+                case function_sum:
+                    op.type.array  = false;
+                    op.type.length = 0;
+                    return true;
+                default:
+                    if (!a.dimension.dimensionless()) {
+                        why = string(function_names[op.function]) + " of " + a.dimension.text() + " (it needs a plain number)";
+                        return false;
+                    }
+                    return true;
+            }
+    }
+    return true;
+}
+
+//
+// ebnf_expressions
+//
+
+enum ebnf_expression_rule {
+    rule_expression, rule_product, rule_unary, rule_power, rule_primary, rule_call,
+    rule_group, rule_array, rule_number, rule_integer, rule_name, rule_definition, rule_space
+};
+
+// Either a value worked out already, or the instruction that will
+// work it out
+struct ebnf_expressions::operand {
+    bool constant;
+    ebnf_value value;
+    uint32_t at;
+    ebnf_type type;
+
+    operand():constant(false), at(0) {}
+};
+
+struct ebnf_expressions::compiling {
+    uint32_t id;   // ebnf_no_rule for units, which aren't definitions
+    definition &d;
+
+    compiling(uint32_t _id, definition &_d):id(_id), d(_d) {}
+};
+
+// A rule's parse, flattened to the rules and text it matched
+struct ebnf_expression_item {
+    const parse_tree *node;
+    config_point start;
+    int rule; // -1 for text
+    string text;
+};
+
+static config_point nowhere() {
+    return config_point(shared_ptr<config_point>(), shared_ptr<config_file>());
+}
+
+static string matched_text(const config_point &start, const config_point &end) {
+    if (end.byte_offset <= start.byte_offset) {
+        return string();
+    }
+    unsigned int length = end.byte_offset - start.byte_offset;
+    const char *data = start.file->bytes(start.byte_offset, length);
+    return data ? string(data, length) : string();
+}
+
+static void flatten(const map<const ebnf_object *, int> &rules,
+                    const parse_tree &node,
+                    const config_point &start,
+                    vector<ebnf_expression_item> &items) {
+    config_point child_start(start);
+    for (auto &i:node.children) {
+        auto found = rules.find(i.owner.get());
+        if (found != rules.end()) {
+            if (found->second != rule_space) {
+                items.push_back({ &i, child_start, found->second, string() });
+            }
+        } else if (i.children.empty()) {
+            string text = matched_text(child_start, i.end);
+            if (!text.empty()) {
+                items.push_back({ &i, child_start, -1, text });
+            }
+        } else {
+            flatten(rules, i, child_start, items);
+        }
+        child_start = i.end;
+    }
+}
+
+ebnf_expressions::definition::definition():state(pending),
+                                           parameter(false),
+                                           constant(false),
+                                           valid(false),
+                                           scale(1),
+                                           expression(0),
+                                           start(nowhere()) {
+}
+
+ebnf_expressions::ebnf_expressions():grammar(new ebnf_expression_grammar()), _evaluations(0) {
+    const char *names[] = { "expression", "product", "unary", "power", "primary", "call",
+                            "group", "array", "number", "integer", "name", "definition" };
+    for (int i=rule_expression; i<=rule_definition; i++) {
+        rules[grammar->rule(names[i]).get()] = i;
+    }
+    rules[grammar->rule("space").get()]  = rule_space;
+    rules[grammar->rule("inline").get()] = rule_space;
+
+    // Only the rules above and the operators between them are looked
+    // at, and names, numbers and spaces only for their text
+    grammar->set_inner_policy(ebnf_flatten);
+    for (auto i:{ "name", "number", "integer", "space", "inline" }) {
+        grammar->set_policy(i, ebnf_collapse);
+    }
+}
+
+shared_ptr<ebnf_expressions> ebnf_expressions::New() {
+    return shared_ptr<ebnf_expressions>(new ebnf_expressions());
+}
+
+shared_ptr<parse_tree> ebnf_expressions::parse(const string &source, const string &text,
+                                               const string &rule, config_point &start) {
+    start = config_point(shared_ptr<config_point>(), memory_file::New(source, text));
+    shared_ptr<parse_tree> root(new parse_tree(shared_ptr<ebnf_object>(), start));
+
+    ebnf_budget budget;
+    if ((grammar->parse_file(*root, rule, budget) != 0) ||
+        (root->end.byte_offset != text.size())) {
+        errors.push_back(source + ": can't make sense of line " + to_string(budget.furthest.line_number + 1));
+        return shared_ptr<parse_tree>();
+    }
+    return root;
+}
+
+bool ebnf_expressions::add(const string &name, shared_ptr<parse_tree> root,
+                           const parse_tree *expression, const config_point &start) {
+    if (ids.count(name)) {
+        errors.push_back(name + " is already defined");
+        return false;
+    }
+    ids[name] = definitions.size();
+    definitions.push_back(definition());
+
+    auto &d(definitions.back());
+    d.name       = name;
+    d.root       = root;
+    d.expression = expression;
+    d.start      = start;
+    return true;
+}
+
+bool ebnf_expressions::load(const string &source, const string &text) {
+    config_point start(nowhere());
+    auto root = parse(source, text, "definitions", start);
+    if (!root) {
+        return false;
+    }
+
+    vector<ebnf_expression_item> lines;
+    flatten(rules, *root, start, lines);
+
+    bool ok = true;
+    for (auto &i:lines) {
+        vector<ebnf_expression_item> parts; // name = expression
+        flatten(rules, *i.node, i.start, parts);
+        string name = matched_text(parts[0].start, parts[0].node->end);
+        ok = add(name, root, parts[2].node, parts[2].start) && ok;
+    }
+    return ok;
+}
+
+bool ebnf_expressions::define(const string &name, const string &expression) {
+    config_point start(nowhere());
+    auto root = parse(name, expression, "formula", start);
+    if (!root) {
+        return false;
+    }
+
+    vector<ebnf_expression_item> parts;
+    flatten(rules, root->children.back(), start, parts);
+    return add(name, root, parts[0].node, parts[0].start);
+}
+
+// The value of a constant expression, like a parameter's unit
+
+bool ebnf_expressions::constant_of(const string &text, ebnf_value &value) {
+    if (text.empty()) {
+        value = ebnf_value();
+        value.data.assign(1, 1);
+        return true;
+    }
+
+    config_point start(nowhere());
+    auto root = parse(text, text, "formula", start);
+    if (!root) {
+        return false;
+    }
+    vector<ebnf_expression_item> parts;
+    flatten(rules, root->children.back(), start, parts);
+
+    definition temporary;
+    temporary.name = text;
+    compiling c(ebnf_no_rule, temporary);
+    operand result;
+    if (!compile(c, *parts[0].node, parts[0].start, result)) {
+        return false;
+    }
+    if (!result.constant || result.type.array) {
+        errors.push_back(text + ": needs to be a single constant");
+        return false;
+    }
+    value = result.value;
+    return true;
+}
+
+bool ebnf_expressions::parameter(const string &name, const string &unit, uint32_t length) {
+    ebnf_value scale;
+    if (!constant_of(unit, scale)) {
+        return false;
+    }
+    if (!add(name, shared_ptr<parse_tree>(), 0, nowhere())) {
+        return false;
+    }
+
+    auto &d(definitions.back());
+    d.state          = definition::compiled;
+    d.parameter      = true;
+    d.scale          = scale.number();
+    d.type.dimension = scale.dimension;
+    d.type.array     = length > 0;
+    d.type.length    = length;
+    static_cast<ebnf_type &>(d.value) = d.type;
+    d.value.data.resize(length ? length : 1);
+    return true;
+}
+
+bool ebnf_expressions::compile() {
+    bool ok = true;
+    for (uint32_t i=0; i<definitions.size(); i++) {
+        if (definitions[i].state == definition::pending) {
+            ok = compile(i) && ok;
+        }
+    }
+    return ok;
+}
+
+bool ebnf_expressions::compile(uint32_t id) {
+    auto &d(definitions[id]);
+    switch (d.state) {
+        case definition::compiled:  return true;
+        case definition::failed:    return false;
+        case definition::compiling: return false; // the caller reports the loop
+        case definition::pending:   break;
+    }
+
+    d.state = definition::compiling;
+    compiling c(id, d);
+    operand result;
+    bool ok = compile(c, *d.expression, d.start, result);
+
+    if (ok && result.constant) {
+        d.constant = true;
+        d.type     = result.value;
+        d.value    = result.value;
+        d.valid    = true;
+        d.code.clear();
+        d.args.clear();
+        d.constants.clear();
+    } else if (ok) {
+        d.type = result.type;
+    }
+
+    // The tree's not needed once it's compiled
+    d.root.reset();
+    d.expression = 0;
+    d.state = ok ? definition::compiled : definition::failed;
+    return ok;
+}
+
+// An instruction for o, if it hasn't got one
+
+uint32_t ebnf_expressions::materialize(compiling &c, const operand &o) {
+    if (!o.constant) {
+        return o.at;
+    }
+    ebnf_instruction op;
+    op.code = ebnf_instruction::constant;
+    op.a    = c.d.constants.size();
+    op.type = o.value;
+    c.d.constants.push_back(o.value);
+    c.d.code.push_back(op);
+    return c.d.code.size() - 1;
+}
+
+// Type check op on a (and b), and either fold it or add it to the code
+
+bool ebnf_expressions::combine(compiling &c, ebnf_instruction op, operand &a, operand *b,
+                               const parse_tree &node, const config_point &start, operand &result) {
+    string why;
+    if (!result_type(op, a.type, b ? &b->type : 0, why)) {
+        errors.push_back(c.d.name + ": " + why + " in \"" + matched_text(start, node.end) + "\"");
+        return false;
+    }
+
+    if (a.constant && (!b || b->constant)) {
+        const ebnf_value *operands[2] = { &a.value, b ? &b->value : &a.value };
+        result.constant = true;
+        apply(op, operands, result.value);
+        result.type = result.value;
+        return true;
+    }
+
+    op.a = materialize(c, a);
+    if (b) {
+        op.b = materialize(c, *b);
+    }
+    result.constant = false;
+    result.type     = op.type;
+    result.at       = c.d.code.size();
+    c.d.code.push_back(op);
+    return true;
+}
+
+bool ebnf_expressions::resolve(compiling &c, const string &name, const string &where, operand &result) {
+    auto found = ids.find(name);
+    if (found == ids.end()) {
+        if (unit_value(name, result.value)) {
+            result.constant = true;
+            result.type     = result.value;
+            return true;
+        }
+        errors.push_back(c.d.name + ": don't know what " + name + " is in \"" + where + "\"");
+        return false;
+    }
+
+    uint32_t id = found->second;
+    if (definitions[id].state == definition::compiling) {
+        if (id == c.id) {
+            errors.push_back(c.d.name + ": is defined in terms of itself");
+        } else {
+            errors.push_back(c.d.name + ": " + name + " and " + c.d.name + " are defined in terms of each other");
+        }
+        return false;
+    }
+    if (!compile(id)) {
+        errors.push_back(c.d.name + ": uses " + name + ", which has errors");
+        return false;
+    }
+
+    auto &d(definitions[id]);
+    if (d.constant) {
+        result.constant = true;
+        result.value    = d.value;
+        result.type     = d.value;
+        return true;
+    }
+    if (c.id == ebnf_no_rule) {
+        errors.push_back(c.d.name + ": " + name + " isn't a constant");
+        return false;
+    }
+
+    ebnf_instruction op;
+    op.code = ebnf_instruction::load;
+    op.a    = id;
+    op.type = d.type;
+    result.constant = false;
+    result.type     = d.type;
+    result.at       = c.d.code.size();
+    c.d.code.push_back(op);
+
+    if (find(d.dependents.begin(), d.dependents.end(), c.id) == d.dependents.end()) {
+        d.dependents.push_back(c.id);
+    }
+    return true;
+}
+
+bool ebnf_expressions::compile(compiling &c, const parse_tree &node, const config_point &start, operand &result) {
+    auto found = rules.find(node.owner.get());
+    int rule = (found == rules.end()) ? -1 : found->second;
+
+    vector<ebnf_expression_item> items;
+    flatten(rules, node, start, items);
+    string where = matched_text(start, node.end);
+
+    switch (rule) {
+        case rule_number: {
+            char *end = 0;
+            double number = strtod(where.c_str(), &end);
+            if (!end || *end) {
+                errors.push_back(c.d.name + ": " + where + " isn't a number");
+                return false;
+            }
+            result.constant = true;
+            result.value    = ebnf_value();
+            result.value.data.assign(1, number);
+            result.type     = result.value;
+            return true;
+        }
+
+        case rule_name:
+            return resolve(c, where, where, result);
+
+        case rule_primary:
+        case rule_group:
+            for (auto &i:items) {
+                if (i.rule >= 0) {
+                    return compile(c, *i.node, i.start, result);
+                }
+            }
+            break;
+
+        case rule_expression:
+        case rule_product: {
+            // Left to right, and in a product two things next to
+            // each other multiply
+            auto next_op = (rule == rule_expression) ? ebnf_instruction::add : ebnf_instruction::multiply;
+            auto op = next_op;
+            bool first = true;
+            for (auto &i:items) {
+                if (i.rule < 0) {
+                    if (i.text == "-") {
+                        op = ebnf_instruction::subtract;
+                    } else if (i.text == "/") {
+                        op = ebnf_instruction::divide;
+                    }
+                    continue;
+                }
+                operand item;
+                if (!compile(c, *i.node, i.start, item)) {
+                    return false;
+                }
+                if (first) {
+                    result = item;
+                    first  = false;
+                } else {
+                    ebnf_instruction instruction;
+                    instruction.code = op;
+                    operand combined;
+                    if (!combine(c, instruction, result, &item, node, start, combined)) {
+                        return false;
+                    }
+                    result = combined;
+                }
+                op = next_op;
+            }
+            return !first;
+        }
+
+        case rule_unary: {
+            bool negative = false;
+            for (auto &i:items) {
+                if (i.rule < 0) {
+                    negative ^= (i.text == "-");
+                    continue;
+                }
+                if (!compile(c, *i.node, i.start, result)) {
+                    return false;
+                }
+            }
+            if (!negative) {
+                return true;
+            }
+            ebnf_instruction instruction;
+            instruction.code = ebnf_instruction::negate;
+            operand value(result);
+            return combine(c, instruction, value, 0, node, start, result);
+        }
+
+        case rule_power: {
+            bool first = true;
+            for (auto &i:items) {
+                if (i.rule < 0) {
+                    continue;
+                }
+                if (first) {
+                    if (!compile(c, *i.node, i.start, result)) {
+                        return false;
+                    }
+                    first = false;
+                    continue;
+                }
+                ebnf_instruction instruction;
+                instruction.code     = ebnf_instruction::power;
+                instruction.exponent = atoi(matched_text(i.start, i.node->end).c_str());
+                operand base(result);
+                if (!combine(c, instruction, base, 0, node, start, result)) {
+                    return false;
+                }
+            }
+            return !first;
+        }
+
+        case rule_call: {
+            string name;
+            operand argument;
+            for (auto &i:items) {
+                if (i.rule == rule_name) {
+                    name = matched_text(i.start, i.node->end);
+                } else if ((i.rule >= 0) && !compile(c, *i.node, i.start, argument)) {
+                    return false;
+                }
+            }
+            ebnf_instruction instruction;
+            instruction.code = ebnf_instruction::call;
+            instruction.function = find(function_names, function_names + functions, name) - function_names;
+            if (instruction.function == functions) {
+                errors.push_back(c.d.name + ": there's no function called " + name);
+                return false;
+            }
+            return combine(c, instruction, argument, 0, node, start, result);
+        }
+
+        case rule_array: {
+            vector<operand> elements;
+            bool constant = true;
+            for (auto &i:items) {
+                if (i.rule < 0) {
+                    continue;
+                }
+                elements.push_back(operand());
+                if (!compile(c, *i.node, i.start, elements.back())) {
+                    return false;
+                }
+                auto &e(elements.back());
+                if (e.type.array || (e.type.dimension != elements[0].type.dimension)) {
+                    errors.push_back(c.d.name + ": array elements need to be numbers in the same units in \"" + where + "\"");
+                    return false;
+                }
+                constant = constant && e.constant;
+            }
+
+            ebnf_type type;
+            if (!elements.empty()) {
+                type.dimension = elements[0].type.dimension;
+            }
+            type.array  = true;
+            type.length = elements.size();
+
+            if (constant) {
+                result.constant = true;
+                result.value    = ebnf_value();
+                static_cast<ebnf_type &>(result.value) = type;
+                for (auto &i:elements) {
+                    result.value.data.push_back(i.value.number());
+                }
+                result.type = type;
+                return true;
+            }
+
+            ebnf_instruction instruction;
+            instruction.code  = ebnf_instruction::pack;
+            instruction.count = elements.size();
+            instruction.type  = type;
+            vector<uint32_t> args;
+            for (auto &i:elements) {
+                args.push_back(materialize(c, i));
+            }
+            instruction.a = c.d.args.size();
+            c.d.args.insert(c.d.args.end(), args.begin(), args.end());
+
+            result.constant = false;
+            result.type     = type;
+            result.at       = c.d.code.size();
+            c.d.code.push_back(instruction);
+            return true;
+        }
+    }
+
+    errors.push_back(c.d.name + ": can't compile \"" + where + "\"");
+    return false;
+}
+
+//
+// Running compiled definitions
+//
+
+void ebnf_expressions::invalidate(uint32_t id) {
+    for (auto i:definitions[id].dependents) {
+        auto &d(definitions[i]);
+        if (d.valid) {
+            d.valid = false;
+            invalidate(i); // (if it's not valid, nothing using it is)
+        }
+    }
+}
+
+bool ebnf_expressions::evaluate(uint32_t id) {
+    auto &d(definitions[id]);
+    if (d.code.empty()) {
+        return false;
+    }
+
+    d.results.resize(d.code.size());
+    d.registers.resize(d.code.size());
+
+    for (size_t i=0; i<d.code.size(); i++) {
+        const ebnf_instruction &op(d.code[i]);
+        switch (op.code) {
+            case ebnf_instruction::constant:
+                d.results[i] = &d.constants[op.a];
+                break;
+
+            case ebnf_instruction::load:
+                d.results[i] = value(op.a);
+                if (!d.results[i]) {
+                    return false;
+                }
+                break;
+
+            case ebnf_instruction::pack: {
+                vector<const ebnf_value *> operands;
+                for (uint32_t j=0; j<op.count; j++) {
+                    operands.push_back(d.results[d.args[op.a + j]]);
+                }
+                apply(op, operands.data(), d.registers[i]);
+                d.results[i] = &d.registers[i];
+                break;
+            }
+
+            default: {
+                const ebnf_value *operands[2] = { d.results[op.a], d.results[op.b] };
+                apply(op, operands, d.registers[i]);
+                d.results[i] = &d.registers[i];
+                break;
+            }
+        }
+    }
+
+    // Swap rather than copy, so the register keeps a buffer to reuse
+    if (d.results.back() == &d.registers.back()) {
+        static_cast<ebnf_type &>(d.value) = d.registers.back();
+        d.value.data.swap(d.registers.back().data);
+    } else {
+        d.value = *d.results.back();
+    }
+    d.valid = true;
+    _evaluations++;
+    return true;
+}
+
+uint32_t ebnf_expressions::id(const string &name) const {
+    auto found = ids.find(name);
+    if (found == ids.end()) {
+        return ebnf_no_rule;
+    }
+    return found->second;
+}
+
+bool ebnf_expressions::set(uint32_t id, const vector<double> &values) {
+    if ((id >= definitions.size()) || !definitions[id].parameter) {
+        errors.push_back(((id < definitions.size()) ? definitions[id].name : string("?")) + " isn't a parameter");
+        return false;
+    }
+    auto &d(definitions[id]);
+    if (values.size() != d.value.data.size()) {
+        errors.push_back(d.name + " needs " + to_string(d.value.data.size()) + " values, not " + to_string(values.size()));
+        return false;
+    }
+    for (size_t i=0; i<values.size(); i++) {
+        d.value.data[i] = values[i] * d.scale;
+    }
+    d.valid = true;
+    invalidate(id);
+    return true;
+}
+
+bool ebnf_expressions::set(const string &name, const vector<double> &values) {
+    uint32_t found = id(name);
+    if (found == ebnf_no_rule) {
+        errors.push_back(name + " isn't a parameter");
+        return false;
+    }
+    return set(found, values);
+}
+
+bool ebnf_expressions::set(const string &name, double value) {
+    return set(name, vector<double>(1, value));
+}
+
+const ebnf_value *ebnf_expressions::value(uint32_t id) {
+    if (id >= definitions.size()) {
+        return 0;
+    }
+    auto &d(definitions[id]);
+    if (d.valid) {
+        return &d.value;
+    }
+    if ((d.state != definition::compiled) || d.parameter) {
+        return 0;
+    }
+    return evaluate(id) ? &d.value : 0;
+}
+
+const ebnf_value *ebnf_expressions::value(const string &name) {
+    return value(id(name));
+}
+
+bool ebnf_expressions::constant(uint32_t id) const {
+    return (id < definitions.size()) && definitions[id].constant;
+}
+
+size_t ebnf_expressions::instructions(uint32_t id) const {
+    return (id < definitions.size()) ? definitions[id].code.size() : 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Unit aware expressions
+ *
+ * Scientific configs are full of derived values: dt = 1 ms / steps,
+ * or an array of positions scaled by a constant.  ebnf_expressions
+ * parses definitions like those (with ebnf_expression_grammar),
+ * checks their units, and compiles each one to a short list of typed
+ * instructions.  Everything that can be worked out when the
+ * definitions are loaded is worked out then: only definitions that
+ * depend on a parameter (a value set at run time) keep any
+ * instructions, and their results are cached until a parameter they
+ * use changes.  A lookup is a check and a pointer.
+ *
+ * Values are kept in SI base units, with their dimension as powers
+ * of the seven base units.  Units are just names: "1 ms" is 1 times
+ * ms, which is 0.001 s.  A name that isn't a definition or a
+ * parameter is looked up as a unit (with SI prefixes).  Adding
+ * different dimensions, or taking the exp of a length, is an error
+ * when the definition is compiled rather than when it's used.
+ *
+ * Arrays ([1, 2, 3] m) work element by element, with scalars
+ * broadcast across them.  The kernels are plain loops over
+ * contiguous doubles, written so the compiler can vectorize them.
+ */
+
+#ifndef __EBNF_EXPRESSION_HPP__
+#define __EBNF_EXPRESSION_HPP__
+
+#include <stdint.h>
+
+#include "ebnf.hpp"
+
+/*
+ The expression syntax.  Juxtaposition multiplies ("3 kg m / s^2"),
+ binding like "*", so "1 ms / steps" is (1 * ms) / steps.  An
+ operator can be followed by a line break, but not preceded by one,
+ so one definition per line works without semicolons.
+
+ definitions = space , { definition , space } ;
+ definition  = name , inline , "=" , space , expression , inline , { ";" } ;
+ formula     = space , expression , space ;
+
+ expression  = product , { inline , ( "+" | "-" ) , space , product } ;
+ product     = unary , { inline , ( "*" | "/" ) , space , unary
+                       | inline , power } ;
+ unary       = { ( "-" | "+" ) , space } , power ;
+ power       = primary , { inline , "^" , space , integer } ;
+ primary     = number | call | name | group | array ;
+ call        = name , inline , "(" , space , expression , space , ")" ;
+ group       = "(" , space , expression , space , ")" ;
+ array       = "[" , space , { expression , space ,
+                               { "," , space , expression , space } } , "]" ;
+
+ number      = digits , { "." , digits } , { ( "e" | "E" ) , { "+" | "-" } , digits } ;
+ integer     = { "-" } , digits ;
+ name        = letter , { letter | digit | "_" } ;
+ digits      = digit , { digit } ;
+ space       = { " " | "\t" | "\r" | "\n" } ;
+ inline      = { " " | "\t" } ;
+
+ (letter includes "_", and µ and Ω for units.)
+ */
+
+class ebnf_expression_grammar:public ebnf_grammar {
+public:
+    ebnf_expression_grammar();
+};
+
+// Powers of the SI base units
+struct ebnf_dimension {
+    enum base_t { metre, kilogram, second, ampere, kelvin, mole, candela, bases };
+    int8_t power[bases];
+
+    ebnf_dimension();
+
+    bool operator==(const ebnf_dimension &other) const;
+    bool operator!=(const ebnf_dimension &other) const { return !(*this == other); }
+
+    // Each returns false if a power would be out of range (or, for
+    // root, isn't a multiple of n)
+    bool times(const ebnf_dimension &other, int sign, ebnf_dimension &result) const;
+    bool raised(int n, ebnf_dimension &result) const;
+    bool root(int n, ebnf_dimension &result) const;
+
+    bool dimensionless() const;
+    string text() const; // like "m kg s^-2", "1" if dimensionless
+};
+
+struct ebnf_type {
+    ebnf_dimension dimension;
+    bool array;
+    uint32_t length; // elements, if it's an array
+
+    ebnf_type():array(false), length(0) {}
+    string text() const;
+};
+
+// In SI base units.  A scalar has one element.
+struct ebnf_value:public ebnf_type {
+    vector<double> data;
+
+    double number() const { return data.empty() ? 0 : data[0]; }
+    string text() const;
+};
+
+// One step of a compiled definition.  Operands are earlier
+// instructions of the same definition.
+struct ebnf_instruction {
+    enum code_t { constant, load, pack, negate, add, subtract, multiply, divide, power, call };
+
+    code_t   code;
+    uint32_t a, b;      // operands; constant: constant number; load: definition id; pack: first arg
+    uint32_t count;     // pack: elements
+    int32_t  exponent;  // power
+    uint32_t function;  // call
+    ebnf_type type;     // of the result, checked when compiled
+
+    ebnf_instruction();
+};
+
+class ebnf_expressions {
+    struct definition {
+        string name;
+        enum state_t { pending, compiling, compiled, failed } state;
+        bool parameter;
+        bool constant;  // folded: the value never changes
+        bool valid;     // value is up to date
+        double scale;   // parameters: set() values are in this unit
+
+        // Where it came from, until it's compiled
+        shared_ptr<parse_tree> root;
+        const parse_tree *expression;
+        config_point start;
+
+        ebnf_type type;
+        vector<ebnf_instruction> code;
+        vector<uint32_t> args;
+        vector<ebnf_value> constants;
+        vector<const ebnf_value *> results; // of each instruction, while evaluating
+        vector<ebnf_value> registers;
+
+        ebnf_value value;
+        vector<uint32_t> dependents; // definitions that load this one
+
+        definition();
+    };
+    struct operand;
+    struct compiling;
+
+    shared_ptr<ebnf_expression_grammar> grammar;
+    map<const ebnf_object *, int> rules; // grammar rule -> what it compiles to
+    map<string, uint32_t> ids;
+    vector<definition> definitions;
+    unsigned long _evaluations;
+
+    ebnf_expressions();
+    shared_ptr<parse_tree> parse(const string &source, const string &text, const string &rule, config_point &start);
+    bool add(const string &name, shared_ptr<parse_tree> root, const parse_tree *expression, const config_point &start);
+    bool compile(uint32_t id);
+    bool compile(compiling &c, const parse_tree &node, const config_point &start, operand &result);
+    bool resolve(compiling &c, const string &name, const string &where, operand &result);
+    uint32_t materialize(compiling &c, const operand &o);
+    bool combine(compiling &c, ebnf_instruction op, operand &a, operand *b, const parse_tree &node, const config_point &start, operand &result);
+    bool constant_of(const string &text, ebnf_value &value);
+    void invalidate(uint32_t id);
+    bool evaluate(uint32_t id);
+public:
+    vector<string> errors; // why loading, compiling or setting something failed
+
+    static shared_ptr<ebnf_expressions> New();
+
+    // Add definitions ("name = expression", one per line or separated
+    // by ;) or a single one.  Nothing is compiled until compile(), so
+    // definitions can use ones that come later.
+    bool load(const string &source, const string &text);
+    bool define(const string &name, const string &expression);
+
+    // A value set at run time, in unit (an expression like "m/s",
+    // or "" for a plain number), with length elements (0 for a
+    // scalar)
+    bool parameter(const string &name, const string &unit, uint32_t length=0);
+
+    // Type check and fold everything added since the last compile
+    bool compile();
+
+    uint32_t id(const string &name) const; // ebnf_no_rule if there's no such thing
+
+    // Values are in the parameter's unit
+    bool set(uint32_t id, const vector<double> &values);
+    bool set(const string &name, const vector<double> &values);
+    bool set(const string &name, double value);
+
+    // The value in SI base units, or 0 if it can't be had (not
+    // compiled, failed, or a parameter it uses isn't set).  The
+    // pointer is good until the next load(), define() or parameter();
+    // what it points at is worked out again after a set() it uses.
+    const ebnf_value *value(uint32_t id);
+    const ebnf_value *value(const string &name);
+
+    bool constant(uint32_t id) const;          // folded when compiled
+    size_t instructions(uint32_t id) const;    // left after folding
+    unsigned long evaluations() const { return _evaluations; }
+};
+
+#endif // __EBNF_EXPRESSION_HPP__
@@ -0,0 +1,314 @@
+#include <fstream>
+#include <sstream>
+
+#include "ebnf_include.hpp"
+
+//
+// file_loader
+//
+
+file_loader::file_loader() {
+}
+
+shared_ptr<file_loader> file_loader::New() {
+    return shared_ptr<file_loader>(new file_loader());
+}
+
+// The directory part of a name, with its trailing slash
+static string directory_of(const string &name) {
+    size_t slash = name.rfind('/');
+    if (slash == string::npos) {
+        return string();
+    }
+    return name.substr(0, slash+1);
+}
+
+// name, relative to the directory of the file from is in
+static string relative_name(const string &name, const config_point &from) {
+    if (name.empty() || (name[0] == '/') || !from.file) {
+        return name;
+    }
+    return directory_of(from.file->name()) + name;
+}
+
+string file_loader::resolve(const string &name, const config_point &from) {
+    return relative_name(name, from);
+}
+
+string file_loader::context(const string &resolved) {
+    return directory_of(resolved);
+}
+
+shared_ptr<config_file> file_loader::load(const string &resolved) {
+    auto found = loaded.find(resolved);
+    if (found != loaded.end()) {
+        return found->second;
+    }
+
+    ifstream in(resolved.c_str(), ios::in | ios::binary);
+    if (!in) {
+        return shared_ptr<config_file>();
+    }
+    stringstream data;
+    data << in.rdbuf();
+
+    shared_ptr<config_file> rv = memory_file::New(resolved, data.str());
+    loaded[resolved] = rv;
+    return rv;
+}
+
+//
+// memory_loader
+//
+
+memory_loader::memory_loader() {
+}
+
+shared_ptr<memory_loader> memory_loader::New() {
+    return shared_ptr<memory_loader>(new memory_loader());
+}
+
+void memory_loader::add(const string &name, const string &data) {
+    files[name] = memory_file::New(name, data);
+}
+
+string memory_loader::resolve(const string &name, const config_point &from) {
+    return relative_name(name, from);
+}
+
+string memory_loader::context(const string &resolved) {
+    return directory_of(resolved);
+}
+
+shared_ptr<config_file> memory_loader::load(const string &resolved) {
+    auto found = files.find(resolved);
+    if (found == files.end()) {
+        return shared_ptr<config_file>();
+    }
+    return found->second;
+}
+
+//
+// ebnf_cache_key
+//
+
+bool ebnf_cache_key::operator<(const ebnf_cache_key &other) const {
+    if (grammar != other.grammar) {
+        return grammar < other.grammar;
+    }
+    if (content != other.content) {
+        return content < other.content;
+    }
+    return context < other.context;
+}
+
+//
+// ebnf_parse_cache
+//
+
+ebnf_parse_cache::ebnf_parse_cache():_hits(0), _misses(0) {
+}
+
+shared_ptr<ebnf_parse_cache> ebnf_parse_cache::New() {
+    return shared_ptr<ebnf_parse_cache>(new ebnf_parse_cache());
+}
+
+bool ebnf_parse_cache::find(const ebnf_cache_key &key, bool &matched, shared_ptr<const parse_tree> &tree) {
+    auto found = entries.find(key);
+    if (found == entries.end()) {
+        _misses++;
+        return false;
+    }
+    _hits++;
+    matched = found->second.matched;
+    tree    = found->second.tree;
+    return true;
+}
+
+void ebnf_parse_cache::store(const ebnf_cache_key &key, bool matched, shared_ptr<const parse_tree> tree) {
+    entry e;
+    e.matched = matched;
+    e.tree    = tree;
+    entries[key] = e;
+}
+
+void ebnf_parse_cache::clear() {
+    entries.clear();
+    errors.clear();
+    _hits   = 0;
+    _misses = 0;
+}
+
+uint64_t ebnf_parse_cache::content_hash(config_file &file) {
+    unsigned int size = file.size();
+    const char *data = file.bytes(0, size);
+    uint64_t length = size;
+    uint64_t hash = ebnf_hash(&length, sizeof(length));
+    return data ? ebnf_hash(data, size, hash) : hash;
+}
+
+//
+// ebnf_include
+//
+
+ebnf_include::ebnf_include(shared_ptr<ebnf_object> path,
+                           shared_ptr<ebnf_object> start,
+                           shared_ptr<config_loader> _loader,
+                           shared_ptr<ebnf_parse_cache> _cache):path_rule(path),
+                                                                start_rule(start),
+                                                                loader(_loader),
+                                                                cache(_cache) {
+}
+
+shared_ptr<ebnf_include> ebnf_include::New(shared_ptr<ebnf_object> path,
+                                           shared_ptr<ebnf_object> start,
+                                           shared_ptr<config_loader> loader,
+                                           shared_ptr<ebnf_parse_cache> cache) {
+    return shared_ptr<ebnf_include>(new ebnf_include(path, start, loader, cache));
+}
+
+const string ebnf_include::description() {
+    return "include";
+}
+
+// Only looks at the directive itself, not what it includes
+
+bool ebnf_include::match(const config_point &where,
+                         config_point &position_after) {
+    return path_rule->match(where, position_after);
+}
+
+static string included_name(const config_point &start, const config_point &end) {
+    if (end.byte_offset <= start.byte_offset) {
+        return string();
+    }
+    unsigned int length = end.byte_offset - start.byte_offset;
+    const char *data = start.file->bytes(start.byte_offset, length);
+    if (!data) {
+        return string();
+    }
+    string name(data, length);
+    if ((name.size() >= 2) &&
+        ((name[0] == '"') || (name[0] == '\'')) &&
+        (name[name.size()-1] == name[0])) {
+        name = name.substr(1, name.size()-2);
+    }
+    return name;
+}
+
+// What to call the start rule in messages: its key, or the name of
+// the rule a reference stands for
+class ebnf_rule_namer:public ebnf_visitor {
+public:
+    string name;
+
+    virtual void visit(ebnf_reference &object) { name = object.name(); }
+};
+
+static string rule_name(ebnf_object &rule) {
+    if (!rule.key.empty()) {
+        return rule.key;
+    }
+    ebnf_rule_namer namer;
+    rule.accept(namer);
+    return namer.name;
+}
+
+bool ebnf_include::parse(parse_tree &tree, ebnf_budget &budget) {
+    ebnf_budget_scope scope(budget, this, tree.end);
+    if (!scope) {
+        return false;
+    }
+
+    config_point start(tree.end);
+    bool collapsed = tree.collapsing();
+
+    // Add ourself...
+    tree.add_child(shared_from_this(), tree.end);
+    budget.node();
+
+    parse_tree &our_tree(tree.children.back());
+
+    if (!path_rule->parse(our_tree, budget)) {
+        tree.children.pop_back();
+        return false;
+    }
+
+    string resolved = loader->resolve(included_name(start, our_tree.end), start);
+
+    // Already on the way here?
+    for (const config_point *p=&start; p; p=p->parent.get()) {
+        if (p->file && (p->file->name() == resolved)) {
+            cache->errors.push_back(start.file->name() + ": include cycle through " + resolved);
+            tree.children.pop_back();
+            return false;
+        }
+    }
+
+    auto file = loader->load(resolved);
+    if (!file) {
+        cache->errors.push_back(start.file->name() + ": can't load " + resolved);
+        tree.children.pop_back();
+        return false;
+    }
+
+    // Policies and linked modules can change the start rule between parses,
+    // and relative includes in the file can resolve differently elsewhere
+    ebnf_cache_key key = { ebnf_fingerprint(vector<shared_ptr<ebnf_object> >(1, start_rule)),
+                           ebnf_parse_cache::content_hash(*file),
+                           ebnf_hash(loader->context(resolved)) };
+
+    bool matched = false;
+    shared_ptr<const parse_tree> included;
+
+    if (!cache->find(key, matched, included)) {
+        shared_ptr<config_point> parent(new config_point(start));
+        shared_ptr<parse_tree> sub(new parse_tree(shared_ptr<ebnf_object>(), config_point(parent, file)));
+
+        matched = start_rule->parse(*sub, budget);
+        if (budget.exceeded != ebnf_budget::none) {
+            tree.children.pop_back();
+            return false;
+        }
+
+        // All of it, or a bad line in an included file would just
+        // quietly end it
+        if (matched && (sub->end.byte_offset != file->size())) {
+            matched = false;
+        }
+        if (matched) {
+            included = sub;
+        }
+        cache->store(key, matched, included);
+    }
+
+    if (!matched) {
+        cache->errors.push_back(start.file->name() + ": " + resolved + " doesn't match " + rule_name(*start_rule));
+        tree.children.pop_back();
+        return false;
+    }
+
+    our_tree.included = included;
+    if (collapsed) {
+        // Only the span is wanted, not what it included
+        tree.end = our_tree.end;
+        tree.children.pop_back();
+        return true;
+    }
+    finish(tree);
+    return true;
+}
+
+void ebnf_include::accept(ebnf_visitor &visitor) {
+    visitor.visit(*this);
+}
+
+shared_ptr<ebnf_object> ebnf_include::copy(ebnf_copies &copies) {
+    auto rv = New(shared_ptr<ebnf_object>(), shared_ptr<ebnf_object>(), loader, cache);
+    rv->key = key;
+    rv->policy = policy;
+    copies[this] = rv;
+    rv->path_rule  = ebnf_copy(path_rule, copies);
+    rv->start_rule = ebnf_copy(start_rule, copies);
+    return rv;
+}
@@ -0,0 +1,113 @@
+/*
+ * Support for ebnf_include: finding included files, and caching
+ * their parses
+ *
+ * Configs tend to include the same shared fragments over and over.
+ * ebnf_parse_cache keys each parse by what can change its result:
+ * the fingerprint of the start rule's grammar (which includes the
+ * start rule's name), a hash of the file's contents, and what the
+ * file's own includes are resolved against (config_loader::context,
+ * its directory for file_loader).  How often the file was included
+ * doesn't matter, so one immutable tree is shared by every include
+ * of the same contents in the same context.  Loaders are expected to
+ * give the same contents for a name for as long as the cache is used
+ * (file_loader only reads each file once).
+ *
+ * Parses that ran out of budget aren't cached, as a bigger budget
+ * might get further.  Failures because of an include cycle are: if a
+ * file's includes lead back to something including it, they lead
+ * back there however that file was reached.
+ */
+
+#ifndef __EBNF_INCLUDE_HPP__
+#define __EBNF_INCLUDE_HPP__
+
+#include "ebnf.hpp"
+
+//
+// Finds included files
+//
+class config_loader {
+public:
+    virtual ~config_loader() {};
+
+    // The full name that name refers to when included at from
+    virtual string resolve(const string &name, const config_point &from) { return name; }
+
+    // What resolve() makes of the includes in the file called resolved,
+    // besides their names.  "" if it doesn't look at where they are.
+    virtual string context(const string &resolved) { return string(); }
+
+    // Returns an empty pointer if it can't be loaded
+    virtual shared_ptr<config_file> load(const string &resolved)=0;
+};
+
+// Loads from the filesystem.  Relative names are relative to the
+// including file's directory.  Each file is only read once.
+class file_loader:public config_loader {
+    map<string, shared_ptr<config_file> > loaded;
+    file_loader();
+public:
+    virtual ~file_loader() {};
+
+    static shared_ptr<file_loader> New();
+
+    virtual string resolve(const string &name, const config_point &from);
+    virtual string context(const string &resolved);
+    virtual shared_ptr<config_file> load(const string &resolved);
+};
+
+// Loads from a set of in-memory files, for embedding and testing.
+// Names are resolved like file_loader's, with "/" between directories.
+class memory_loader:public config_loader {
+    map<string, shared_ptr<config_file> > files;
+    memory_loader();
+public:
+    virtual ~memory_loader() {};
+
+    static shared_ptr<memory_loader> New();
+
+    void add(const string &name, const string &data);
+    virtual string resolve(const string &name, const config_point &from);
+    virtual string context(const string &resolved);
+    virtual shared_ptr<config_file> load(const string &resolved);
+};
+
+//
+// The cache
+//
+struct ebnf_cache_key {
+    uint64_t grammar;   // ebnf_fingerprint of the start rule (which covers its name)
+    uint64_t content;   // ebnf_parse_cache::content_hash of the file
+    uint64_t context;   // ebnf_hash of config_loader::context for the file
+
+    bool operator<(const ebnf_cache_key &other) const;
+};
+
+class ebnf_parse_cache {
+    struct entry {
+        bool matched;
+        shared_ptr<const parse_tree> tree;
+    };
+    map<ebnf_cache_key, entry> entries;
+    unsigned long _hits, _misses;
+
+    ebnf_parse_cache();
+public:
+    vector<string> errors; // why includes failed (cycles, missing files, ...)
+
+    static shared_ptr<ebnf_parse_cache> New();
+
+    // Returns false if there's no entry for key
+    bool find(const ebnf_cache_key &key, bool &matched, shared_ptr<const parse_tree> &tree);
+    void store(const ebnf_cache_key &key, bool matched, shared_ptr<const parse_tree> tree);
+    void clear();
+
+    static uint64_t content_hash(config_file &file);
+
+    unsigned long hits() const { return _hits; }
+    unsigned long misses() const { return _misses; }
+    size_t size() const { return entries.size(); }
+};
+
+#endif // __EBNF_INCLUDE_HPP__
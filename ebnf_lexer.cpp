@@ -0,0 +1,484 @@
+#include <algorithm>
+#include <set>
+
+#include "ebnf_lexer.hpp"
+#include "ebnf_sets.hpp"
+
+//
+// Thompson construction
+//
+
+struct ebnf_nfa_state {
+    vector<uint32_t> epsilon;
+    vector<pair<bitset<256>, uint32_t> > edges;
+    int32_t accept; // token kind, or -1
+
+    ebnf_nfa_state():accept(-1) {}
+};
+
+class ebnf_nfa_builder:public ebnf_visitor {
+    vector<ebnf_nfa_state> &states;
+    const ebnf_sets &sets;
+    set<const ebnf_object *> active; // objects we're inside of, to catch recursion
+    uint32_t start, end;             // fragment for the object just visited
+
+    uint32_t state() {
+        states.push_back(ebnf_nfa_state());
+        return states.size()-1;
+    }
+    void epsilon(uint32_t from, uint32_t to) {
+        states[from].epsilon.push_back(to);
+    }
+public:
+    string error;
+
+    ebnf_nfa_builder(vector<ebnf_nfa_state> &_states, const ebnf_sets &_sets):states(_states), sets(_sets), start(0), end(0) {}
+
+    // Builds a fragment matching object, returns false on error
+    bool build(const shared_ptr<ebnf_object> &object, uint32_t &first, uint32_t &last) {
+        if (!error.empty()) {
+            return false;
+        }
+        if (active.count(object.get())) {
+            error = "recursive rule '" + object->key + "' is not regular";
+            return false;
+        }
+        active.insert(object.get());
+        object->accept(*this);
+        active.erase(object.get());
+
+        first = start;
+        last  = end;
+        return error.empty();
+    }
+
+    virtual void visit(ebnf_string &object) {
+        uint32_t first = state();
+        uint32_t last = first;
+        for (auto c:object.text()) {
+            uint32_t next = state();
+            bitset<256> bytes;
+            bytes.set((unsigned char)c);
+            states[last].edges.push_back(make_pair(bytes, next));
+            last = next;
+        }
+        start = first;
+        end   = last;
+    }
+
+    virtual void visit(ebnf_alternation &object) {
+        uint32_t first = state();
+        uint32_t last  = state();
+        for (auto &i:object.items()) {
+            uint32_t s, e;
+            if (!build(i, s, e)) {
+                return;
+            }
+            epsilon(first, s);
+            epsilon(e, last);
+        }
+        start = first;
+        end   = last;
+    }
+
+    virtual void visit(ebnf_concatenation &object) {
+        uint32_t first = state();
+        uint32_t last  = first;
+        for (auto &i:object.items()) {
+            uint32_t s, e;
+            if (!build(i, s, e)) {
+                return;
+            }
+            epsilon(last, s);
+            last = e;
+        }
+        start = first;
+        end   = last;
+    }
+
+    virtual void visit(ebnf_exception &object) {
+        if (object.everything()) {
+            error = "exception with a left hand side is not regular";
+            return;
+        }
+        bitset<256> bytes;
+        bytes.set();
+        if (object.except()) {
+            bytes &= ~sets.of(object.except()).first_bytes;
+        }
+        start = state();
+        end   = state();
+        states[start].edges.push_back(make_pair(bytes, end));
+    }
+
+    virtual void visit(ebnf_repetition &object) {
+        uint32_t first = state();
+        uint32_t last  = state();
+        epsilon(first, last);
+        if (object.item()) {
+            uint32_t s, e;
+            if (!build(object.item(), s, e)) {
+                return;
+            }
+            epsilon(first, s);
+            epsilon(e, s);
+            epsilon(e, last);
+        }
+        start = first;
+        end   = last;
+    }
+
+    virtual void visit(ebnf_token &object) {
+        uint32_t s, e;
+        if (build(object.source(), s, e)) {
+            start = s;
+            end   = e;
+        }
+    }
+
+    virtual void visit(ebnf_include &object) {
+        error = "include can't be part of a token";
+    }
+
+    virtual void visit(ebnf_reference &object) {
+        auto rule = object.rule();
+        if (!rule) {
+            error = object.name() + " isn't defined";
+            return;
+        }
+        uint32_t s, e;
+        if (build(rule, s, e)) {
+            start = s;
+            end   = e;
+        }
+    }
+};
+
+static void epsilon_closure(const vector<ebnf_nfa_state> &states, vector<uint32_t> &closure) {
+    vector<bool> in(states.size(), false);
+    vector<uint32_t> pending(closure);
+    for (auto i:closure) {
+        in[i] = true;
+    }
+    while (!pending.empty()) {
+        uint32_t s = pending.back();
+        pending.pop_back();
+        for (auto next:states[s].epsilon) {
+            if (!in[next]) {
+                in[next] = true;
+                closure.push_back(next);
+                pending.push_back(next);
+            }
+        }
+    }
+    sort(closure.begin(), closure.end());
+}
+
+//
+// ebnf_lexer
+//
+
+ebnf_lexer::ebnf_lexer():classes(0), start(0), _fingerprint(0) {
+    for (int i=0; i<256; i++) {
+        byte_class[i] = 0;
+    }
+}
+
+shared_ptr<ebnf_lexer> ebnf_lexer::New(const ebnf_grammar &grammar,
+                                       const vector<string> &token_rules,
+                                       string &error) {
+    auto rv = shared_ptr<ebnf_lexer>(new ebnf_lexer());
+
+    for (auto &i:token_rules) {
+        auto rule = grammar.rule(i);
+        if (!rule) {
+            error = "no such rule '" + i + "'";
+            return shared_ptr<ebnf_lexer>();
+        }
+        rv->names.push_back(i);
+        rv->rules.push_back(rule);
+    }
+
+    if (!rv->build(grammar, error)) {
+        return shared_ptr<ebnf_lexer>();
+    }
+
+    uint64_t hash = ebnf_hash_seed;
+    for (auto &i:rv->names) {
+        hash = ebnf_hash(i, hash);
+    }
+    hash = ebnf_hash(rv->byte_class, sizeof(rv->byte_class), hash);
+    hash = ebnf_hash(&rv->start, sizeof(rv->start), hash);
+    hash = ebnf_hash(rv->transitions.data(), rv->transitions.size() * sizeof(uint32_t), hash);
+    hash = ebnf_hash(rv->accepts.data(), rv->accepts.size() * sizeof(int32_t), hash);
+    rv->_fingerprint = hash;
+    return rv;
+}
+
+bool ebnf_lexer::build(const ebnf_grammar &grammar, string &error) {
+    auto sets = ebnf_sets::New(grammar);
+
+    // One NFA with a branch per token kind
+
+    vector<ebnf_nfa_state> nfa(1);
+    ebnf_nfa_builder builder(nfa, *sets);
+
+    for (uint32_t kind=0; kind<rules.size(); kind++) {
+        uint32_t s, e;
+        if (!builder.build(rules[kind], s, e)) {
+            error = names[kind] + ": " + builder.error;
+            return false;
+        }
+        nfa[0].epsilon.push_back(s);
+        nfa[e].accept = kind;
+
+        vector<uint32_t> closure(1, s);
+        epsilon_closure(nfa, closure);
+        nullable.push_back(binary_search(closure.begin(), closure.end(), e));
+    }
+
+    // Bytes that every edge treats the same way share a class
+
+    vector<bitset<256> > distinct;
+    for (auto &s:nfa) {
+        for (auto &e:s.edges) {
+            if (find(distinct.begin(), distinct.end(), e.first) == distinct.end()) {
+                distinct.push_back(e.first);
+            }
+        }
+    }
+
+    map<vector<bool>, uint32_t> signatures;
+    vector<unsigned char> representative;
+    for (int b=0; b<256; b++) {
+        vector<bool> signature;
+        for (auto &d:distinct) {
+            signature.push_back(d.test(b));
+        }
+        auto found = signatures.find(signature);
+        if (found == signatures.end()) {
+            found = signatures.insert(make_pair(signature, (uint32_t)representative.size())).first;
+            representative.push_back(b);
+        }
+        byte_class[b] = found->second;
+    }
+    classes = representative.size();
+
+    // Subset construction.  DFA state 0 is the empty (dead) set.
+
+    map<vector<uint32_t>, uint32_t> dfa_index;
+    vector<vector<uint32_t> > dfa_states;
+    vector<uint32_t> dfa_transitions;
+
+    dfa_states.push_back(vector<uint32_t>());
+    dfa_index[dfa_states.back()] = 0;
+
+    vector<uint32_t> initial(1, 0);
+    epsilon_closure(nfa, initial);
+    dfa_index[initial] = 1;
+    dfa_states.push_back(initial);
+
+    for (size_t d=0; d<dfa_states.size(); d++) {
+        for (uint32_t c=0; c<classes; c++) {
+            unsigned char b = representative[c];
+            vector<uint32_t> next;
+            for (auto s:dfa_states[d]) {
+                for (auto &e:nfa[s].edges) {
+                    if (e.first.test(b)) {
+                        next.push_back(e.second);
+                    }
+                }
+            }
+            sort(next.begin(), next.end());
+            next.erase(unique(next.begin(), next.end()), next.end());
+            epsilon_closure(nfa, next);
+
+            auto found = dfa_index.find(next);
+            if (found == dfa_index.end()) {
+                found = dfa_index.insert(make_pair(next, (uint32_t)dfa_states.size())).first;
+                dfa_states.push_back(next);
+            }
+            dfa_transitions.push_back(found->second);
+        }
+    }
+
+    // The earliest listed token wins a tie
+
+    vector<int32_t> dfa_accepts;
+    for (auto &d:dfa_states) {
+        int32_t accept = -1;
+        for (auto s:d) {
+            if ((nfa[s].accept >= 0) && ((accept < 0) || (nfa[s].accept < accept))) {
+                accept = nfa[s].accept;
+            }
+        }
+        dfa_accepts.push_back(accept);
+    }
+
+    // Moore minimization: split groups until every state in a group
+    // accepts the same token and moves to the same groups
+
+    vector<uint32_t> group(dfa_states.size());
+    size_t groups = 0;
+    {
+        map<int32_t, uint32_t> by_accept;
+        for (size_t d=0; d<dfa_states.size(); d++) {
+            auto found = by_accept.insert(make_pair(dfa_accepts[d], (uint32_t)by_accept.size())).first;
+            group[d] = found->second;
+        }
+        groups = by_accept.size();
+    }
+
+    while (true) {
+        map<vector<uint32_t>, uint32_t> by_signature;
+        vector<uint32_t> next_group(dfa_states.size());
+        for (size_t d=0; d<dfa_states.size(); d++) {
+            vector<uint32_t> signature(1, group[d]);
+            for (uint32_t c=0; c<classes; c++) {
+                signature.push_back(group[dfa_transitions[d*classes + c]]);
+            }
+            auto found = by_signature.insert(make_pair(signature, (uint32_t)by_signature.size())).first;
+            next_group[d] = found->second;
+        }
+        group.swap(next_group);
+        if (by_signature.size() == groups) {
+            break;
+        }
+        groups = by_signature.size();
+    }
+
+    // Renumber so the dead state's group is 0
+
+    vector<uint32_t> renumber(groups, (uint32_t)-1);
+    uint32_t used = 0;
+    renumber[group[0]] = used++;
+    for (size_t d=0; d<dfa_states.size(); d++) {
+        if (renumber[group[d]] == (uint32_t)-1) {
+            renumber[group[d]] = used++;
+        }
+    }
+
+    transitions.assign(groups * classes, 0);
+    accepts.assign(groups, -1);
+    for (size_t d=0; d<dfa_states.size(); d++) {
+        uint32_t g = renumber[group[d]];
+        accepts[g] = dfa_accepts[d];
+        for (uint32_t c=0; c<classes; c++) {
+            transitions[g*classes + c] = renumber[group[dfa_transitions[d*classes + c]]];
+        }
+    }
+    start = renumber[group[1]];
+
+    // Merging states can leave bytes that now behave the same (every
+    // letter, say) in different classes, so redo the classes from
+    // the columns of the minimized table
+
+    map<vector<uint32_t>, uint32_t> columns;
+    vector<uint32_t> merged_class(classes);
+    vector<uint32_t> merged_from;
+    for (uint32_t c=0; c<classes; c++) {
+        vector<uint32_t> column;
+        for (uint32_t g=0; g<groups; g++) {
+            column.push_back(transitions[g*classes + c]);
+        }
+        auto found = columns.insert(make_pair(column, (uint32_t)merged_from.size())).first;
+        if (found->second == merged_from.size()) {
+            merged_from.push_back(c);
+        }
+        merged_class[c] = found->second;
+    }
+
+    vector<uint32_t> merged(groups * merged_from.size());
+    for (uint32_t g=0; g<groups; g++) {
+        for (uint32_t c=0; c<merged_from.size(); c++) {
+            merged[g*merged_from.size() + c] = transitions[g*classes + merged_from[c]];
+        }
+    }
+    for (int b=0; b<256; b++) {
+        byte_class[b] = merged_class[byte_class[b]];
+    }
+    classes = merged_from.size();
+    transitions.swap(merged);
+
+    return true;
+}
+
+void ebnf_lexer::tokenize(const string &data, vector<ebnf_token_span> &tokens) const {
+    const unsigned char *bytes = (const unsigned char *)data.data();
+    size_t length = data.size();
+    size_t p = 0;
+
+    while (p < length) {
+        // longest match from p
+        uint32_t state = start;
+        int32_t kind = -1;
+        size_t end = p;
+
+        for (size_t q=p; state && (q < length); q++) {
+            state = transitions[state*classes + byte_class[bytes[q]]];
+            if (accepts[state] >= 0) {
+                kind = accepts[state];
+                end  = q+1;
+            }
+        }
+
+        if (kind < 0) {
+            p++; // not the start of any token
+            continue;
+        }
+
+        ebnf_token_span token = { (uint32_t)kind, (uint32_t)p, (uint32_t)end };
+        tokens.push_back(token);
+        p = end;
+    }
+}
+
+shared_ptr<ebnf_grammar> ebnf_lexer::syntax(const ebnf_grammar &grammar) const {
+    ebnf_copies copies;
+    for (uint32_t kind=0; kind<rules.size(); kind++) {
+        copies[rules[kind].get()] = ebnf_token::New(kind, nullable[kind], rules[kind]);
+    }
+
+    auto rv = ebnf_grammar::New();
+    for (auto &i:grammar.rules()) {
+        rv->add(i.first, ebnf_copy(i.second, copies));
+    }
+    return rv;
+}
+
+//
+// token_file
+//
+
+token_file::token_file(string &name, string &data, const ebnf_lexer &lexer):memory_file(name, data),
+                                                                             lexer_fingerprint(lexer.fingerprint()) {
+    lexer.tokenize(this->data, tokens);
+}
+
+shared_ptr<token_file> token_file::New(string name, string data, const ebnf_lexer &lexer) {
+    return shared_ptr<token_file>(new token_file(name, data, lexer));
+}
+
+bool token_file::token(const config_point &where,
+                       unsigned int kind,
+                       config_point &position_after) {
+    auto found = lower_bound(tokens.begin(), tokens.end(), where.byte_offset,
+                             [](const ebnf_token_span &t, unsigned int offset) {
+                                 return t.start < offset;
+                             });
+    if ((found == tokens.end()) || (found->start != where.byte_offset) || (found->kind != kind)) {
+        return false;
+    }
+
+    position_after = where;
+    for (uint32_t i=found->start; i<found->end; i++) {
+        if (data[i] == '\n') {
+            position_after.line_number++;
+            position_after.line_offset = 0;
+        } else {
+            position_after.line_offset++;
+        }
+    }
+    position_after.byte_offset = found->end;
+    return true;
+}
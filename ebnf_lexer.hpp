@@ -0,0 +1,92 @@
+/*
+ * Table driven lexer built from the regular rules of a grammar
+ *
+ * Lexical rules (identifier, whitespace, digit, ...) are normally
+ * parsed a character at a time through the same recursive objects
+ * as everything else, which costs a couple of ebnf_object calls per
+ * byte.  Instead, the rules named as tokens are compiled into one
+ * minimized DFA (Thompson NFA -> subset construction -> Moore
+ * partition refinement) over a table of byte classes, and a file
+ * is cut into tokens in a single forward pass.
+ *
+ * syntax() then returns a copy of the grammar where each token rule
+ * is replaced by an ebnf_token, so the syntactic rules step over a
+ * whole token at a time when handed a token_file.
+ *
+ * Only the regular subset can be compiled: no rule may reach itself,
+ * and an ebnf_exception must not have a left hand side (a bare one
+ * is "one byte that doesn't start the exception", as in ebnf_sets
+ * and ebnf_exception::parse).  Tokens are the longest match at each point; ties go
+ * to the token listed first.  Bytes that don't start any token are
+ * left for the syntactic rules to match as plain strings.
+ */
+
+#ifndef __EBNF_LEXER_HPP__
+#define __EBNF_LEXER_HPP__
+
+#include <stdint.h>
+
+#include "ebnf.hpp"
+
+struct ebnf_token_span {
+    uint32_t kind;   // index into the token rules handed to the lexer
+    uint32_t start;  // byte offset of the first byte
+    uint32_t end;    // byte offset just past the last byte
+};
+
+class ebnf_lexer {
+    vector<string> names;                   // token kind -> rule name
+    vector<shared_ptr<ebnf_object> > rules; // token kind -> rule
+    vector<bool> nullable;                  // token kind -> rule can match empty
+
+    // DFA.  State 0 is dead: once there nothing more can match.
+    uint8_t byte_class[256];
+    uint32_t classes;
+    uint32_t start;
+    vector<uint32_t> transitions;           // [state * classes + class]
+    vector<int32_t>  accepts;               // token kind accepted in state, or -1
+    uint64_t _fingerprint;                  // of the kinds and tables above
+
+    ebnf_lexer();
+    bool build(const ebnf_grammar &grammar, string &error);
+public:
+    // Returns an empty pointer (and says why in error) if a rule
+    // doesn't exist or isn't regular
+    static shared_ptr<ebnf_lexer> New(const ebnf_grammar &grammar,
+                                      const vector<string> &token_rules,
+                                      string &error);
+
+    void tokenize(const string &data, vector<ebnf_token_span> &tokens) const;
+
+    // A copy of grammar with every token rule replaced by an ebnf_token
+    shared_ptr<ebnf_grammar> syntax(const ebnf_grammar &grammar) const;
+
+    const string &kind_name(uint32_t kind) const { return names[kind]; }
+    size_t kinds() const { return names.size(); }
+    size_t states() const { return accepts.size(); }
+    size_t byte_classes() const { return classes; }
+
+    // Equal for lexers that cut every file into the same tokens
+    uint64_t fingerprint() const { return _fingerprint; }
+};
+
+//
+// A memory_file that has been run through an ebnf_lexer
+//
+class token_file:public memory_file {
+    vector<ebnf_token_span> tokens;
+    uint64_t lexer_fingerprint;
+    token_file(string &name, string &data, const ebnf_lexer &lexer);
+public:
+    static shared_ptr<token_file> New(string name, string data, const ebnf_lexer &lexer);
+
+    virtual bool tokenized() { return true; }
+    virtual bool token(const config_point &where,
+                       unsigned int kind,
+                       config_point &position_after);
+    virtual uint64_t lexer() { return lexer_fingerprint; }
+
+    const vector<ebnf_token_span> &token_spans() const { return tokens; }
+};
+
+#endif // __EBNF_LEXER_HPP__
@@ -121,18 +121,18 @@ ebnf_parser::ebnf_parser() {
     add("lhs", lhs);
     
     
-    // rhs
-    // well, this is fun... it's recursive so it has to late bind...
+    // rhs is recursive, so everything inside it uses it by name
+    // and link() ties the knot once it's been added
+    
+    auto rhs_reference = ebnf_reference::New("rhs");
     
-    auto rhs = ebnf_alternation::New();
-
     
     // optional
     
     auto optional = ebnf_concatenation::New();
     
     *optional << ebnf_string::New("[")
-              << rhs
+              << rhs_reference
               << ebnf_string::New("]");
     
     add("optional", optional);
@@ -143,7 +143,7 @@ ebnf_parser::ebnf_parser() {
     auto repetition = ebnf_concatenation::New();
     
     *repetition << ebnf_string::New("{")
-                << rhs
+                << rhs_reference
                 << ebnf_string::New("}");
     
     add("repetition", repetition);
@@ -153,7 +153,7 @@ ebnf_parser::ebnf_parser() {
     auto group = ebnf_concatenation::New();
     
     *group << ebnf_string::New("(")
-           << rhs
+           << rhs_reference
            << ebnf_string::New(")");
     
     add("group", group);
@@ -162,21 +162,22 @@ ebnf_parser::ebnf_parser() {
     
     auto alternation = ebnf_concatenation::New();
     
-    *alternation << rhs
+    *alternation << rhs_reference
                  << ebnf_string::New("|")
-                 << rhs;
+                 << rhs_reference;
     
     add("alternation", alternation);
 
     
     auto concatenation = ebnf_concatenation::New();
     
-    *concatenation << rhs
+    *concatenation << rhs_reference
                    << ebnf_string::New(",")
-                   << rhs;
+                   << rhs_reference;
     
     add("concatenation", concatenation);
     
+    auto rhs = ebnf_alternation::New();
     *rhs << identifier << terminal << optional << repetition << group << alternation << concatenation;
     
     add("rhs", rhs);
@@ -187,5 +188,5 @@ ebnf_parser::ebnf_parser() {
     *rule << lhs << whitespace << ebnf_string::New("=") << whitespace << rhs << whitespace << ebnf_string::New(";");
     add("rule", rule);
     
-    
+    link();
 }
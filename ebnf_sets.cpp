@@ -0,0 +1,302 @@
+#include "ebnf_sets.hpp"
+
+//
+// ebnf_object_sets
+//
+
+ebnf_object_sets::ebnf_object_sets():nullable(false), follow_end(false) {}
+
+//
+// Helpers
+//
+
+// Recomputes nullable/FIRST for one object from its children.
+// Sets changed if anything grew.
+
+class ebnf_first_step:public ebnf_visitor {
+    const ebnf_sets &sets;
+    ebnf_object_sets &target;
+
+    void merge(bool nullable, const set<string> &first, const bitset<256> &first_bytes) {
+        if (nullable && !target.nullable) {
+            target.nullable = true;
+            changed = true;
+        }
+        size_t size = target.first.size();
+        target.first.insert(first.begin(), first.end());
+        if (target.first.size() != size) {
+            changed = true;
+        }
+        if ((target.first_bytes | first_bytes) != target.first_bytes) {
+            target.first_bytes |= first_bytes;
+            changed = true;
+        }
+    }
+public:
+    bool changed;
+
+    ebnf_first_step(const ebnf_sets &_sets, ebnf_object_sets &_target):sets(_sets), target(_target), changed(false) {}
+
+    virtual void visit(ebnf_string &object) {
+        set<string> first;
+        bitset<256> first_bytes;
+        if (object.text().empty()) {
+            merge(true, first, first_bytes);
+            return;
+        }
+        first.insert(object.text());
+        first_bytes.set((unsigned char)object.text()[0]);
+        merge(false, first, first_bytes);
+    }
+
+    virtual void visit(ebnf_alternation &object) {
+        for (auto &i:object.items()) {
+            auto &child(sets.of(i));
+            merge(child.nullable, child.first, child.first_bytes);
+        }
+    }
+
+    virtual void visit(ebnf_concatenation &object) {
+        set<string> first;
+        bitset<256> first_bytes;
+        bool nullable = sets.first_of_sequence(object.items(), 0, first, first_bytes);
+        merge(nullable, first, first_bytes);
+    }
+
+    virtual void visit(ebnf_exception &object) {
+        if (object.everything()) {
+            auto &child(sets.of(object.everything()));
+            merge(child.nullable, child.first, child.first_bytes);
+            return;
+        }
+        // A single character that doesn't start the exception
+        bitset<256> first_bytes;
+        first_bytes.set();
+        if (object.except()) {
+            first_bytes &= ~sets.of(object.except()).first_bytes;
+        }
+        merge(false, set<string>(), first_bytes);
+    }
+
+    virtual void visit(ebnf_repetition &object) {
+        set<string> first;
+        bitset<256> first_bytes;
+        if (object.item()) {
+            auto &child(sets.of(object.item()));
+            first = child.first;
+            first_bytes = child.first_bytes;
+        }
+        merge(true, first, first_bytes); // matching 0 times is valid...
+    }
+
+    virtual void visit(ebnf_token &object) {
+        auto &child(sets.of(object.source()));
+        merge(child.nullable, child.first, child.first_bytes);
+    }
+
+    // What's included doesn't show up in this file
+    virtual void visit(ebnf_include &object) {
+        auto &child(sets.of(object.path()));
+        merge(child.nullable, child.first, child.first_bytes);
+    }
+
+    // Unlinked references match nothing, so leave them empty
+    virtual void visit(ebnf_reference &object) {
+        auto rule = object.rule();
+        if (rule) {
+            auto &child(sets.of(rule));
+            merge(child.nullable, child.first, child.first_bytes);
+        }
+    }
+};
+
+// Pushes FOLLOW of one object down into its children.
+// Sets changed if any child grew.
+
+class ebnf_follow_step:public ebnf_visitor {
+    ebnf_sets &sets;
+    const ebnf_object_sets &source;
+
+    void merge(ebnf_object_sets &target,
+               const set<string> &follow,
+               const bitset<256> &follow_bytes,
+               bool follow_end) {
+        size_t size = target.follow.size();
+        target.follow.insert(follow.begin(), follow.end());
+        if (target.follow.size() != size) {
+            changed = true;
+        }
+        if ((target.follow_bytes | follow_bytes) != target.follow_bytes) {
+            target.follow_bytes |= follow_bytes;
+            changed = true;
+        }
+        if (follow_end && !target.follow_end) {
+            target.follow_end = true;
+            changed = true;
+        }
+    }
+
+    ebnf_object_sets &writable(const shared_ptr<ebnf_object> &object) {
+        return const_cast<ebnf_object_sets &>(sets.of(object));
+    }
+public:
+    bool changed;
+
+    ebnf_follow_step(ebnf_sets &_sets, const ebnf_object_sets &_source):sets(_sets), source(_source), changed(false) {}
+
+    virtual void visit(ebnf_alternation &object) {
+        for (auto &i:object.items()) {
+            merge(writable(i), source.follow, source.follow_bytes, source.follow_end);
+        }
+    }
+
+    virtual void visit(ebnf_concatenation &object) {
+        auto &items(object.items());
+        for (size_t i=0; i<items.size(); i++) {
+            set<string> follow;
+            bitset<256> follow_bytes;
+            bool rest_nullable = sets.first_of_sequence(items, i+1, follow, follow_bytes);
+            if (rest_nullable) {
+                follow.insert(source.follow.begin(), source.follow.end());
+                follow_bytes |= source.follow_bytes;
+            }
+            merge(writable(items[i]), follow, follow_bytes, rest_nullable && source.follow_end);
+        }
+    }
+
+    virtual void visit(ebnf_exception &object) {
+        if (object.everything()) {
+            merge(writable(object.everything()), source.follow, source.follow_bytes, source.follow_end);
+        }
+    }
+
+    virtual void visit(ebnf_repetition &object) {
+        if (!object.item()) {
+            return;
+        }
+        auto &item(writable(object.item()));
+        // whatever starts another round, or whatever follows us
+        set<string> follow(item.first);
+        bitset<256> follow_bytes(item.first_bytes);
+        follow.insert(source.follow.begin(), source.follow.end());
+        follow_bytes |= source.follow_bytes;
+        merge(item, follow, follow_bytes, source.follow_end);
+    }
+
+    virtual void visit(ebnf_token &object) {
+        merge(writable(object.source()), source.follow, source.follow_bytes, source.follow_end);
+    }
+
+    virtual void visit(ebnf_include &object) {
+        merge(writable(object.path()), source.follow, source.follow_bytes, source.follow_end);
+    }
+
+    virtual void visit(ebnf_reference &object) {
+        auto rule = object.rule();
+        if (rule) {
+            merge(writable(rule), source.follow, source.follow_bytes, source.follow_end);
+        }
+    }
+};
+
+//
+// ebnf_sets
+//
+
+ebnf_sets::ebnf_sets() {
+}
+
+shared_ptr<ebnf_sets> ebnf_sets::New(const ebnf_grammar &grammar) {
+    vector<shared_ptr<ebnf_object> > roots;
+    for (auto &i:grammar.rules()) {
+        roots.push_back(i.second);
+    }
+    return New(roots);
+}
+
+shared_ptr<ebnf_sets> ebnf_sets::New(const vector<shared_ptr<ebnf_object> > &roots) {
+    auto rv = shared_ptr<ebnf_sets>(new ebnf_sets());
+
+    for (auto &i:roots) {
+        rv->collect(i);
+    }
+    rv->sets.resize(rv->objects.size());
+
+    rv->compute_first();
+    rv->compute_follow(roots);
+
+    return rv;
+}
+
+void ebnf_sets::collect(const shared_ptr<ebnf_object> &root) {
+    // Iterative so that deep grammars don't run us out of stack
+    vector<shared_ptr<ebnf_object> > pending;
+    pending.push_back(root);
+
+    while (!pending.empty()) {
+        auto object = pending.back();
+        pending.pop_back();
+
+        if (!object || index.count(object.get())) {
+            continue;
+        }
+        index[object.get()] = objects.size();
+        objects.push_back(object);
+
+        ebnf_children children;
+        object->accept(children);
+        pending.insert(pending.end(), children.children.rbegin(), children.children.rend());
+    }
+}
+
+void ebnf_sets::compute_first() {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i=0; i<objects.size(); i++) {
+            ebnf_first_step step(*this, sets[i]);
+            objects[i]->accept(step);
+            changed |= step.changed;
+        }
+    }
+}
+
+void ebnf_sets::compute_follow(const vector<shared_ptr<ebnf_object> > &roots) {
+    // Any rule may be handed to parse_file as the start rule
+    for (auto &i:roots) {
+        sets[index[i.get()]].follow_end = true;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i=0; i<objects.size(); i++) {
+            ebnf_follow_step step(*this, sets[i]);
+            objects[i]->accept(step);
+            changed |= step.changed;
+        }
+    }
+}
+
+bool ebnf_sets::contains(const ebnf_object *object) const {
+    return index.count(object) != 0;
+}
+
+const ebnf_object_sets &ebnf_sets::of(const ebnf_object *object) const {
+    return sets[index.at(object)];
+}
+
+bool ebnf_sets::first_of_sequence(const vector<shared_ptr<ebnf_object> > &items,
+                                  size_t from,
+                                  set<string> &first,
+                                  bitset<256> &first_bytes) const {
+    for (size_t i=from; i<items.size(); i++) {
+        auto &item(of(items[i]));
+        first.insert(item.first.begin(), item.first.end());
+        first_bytes |= item.first_bytes;
+        if (!item.nullable) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,68 @@
+/*
+ * nullable / FIRST / FOLLOW sets for an ebnf_grammar
+ *
+ * These are the classic LL analysis sets, computed once per grammar
+ * (fixed point iteration over every reachable ebnf_object) so that
+ * completion, analysis, etc. can look them up instead of walking
+ * the grammar on every keystroke.
+ *
+ * Terminals are tracked two ways:  as the literal strings that may
+ * appear next (what we show a user), and as a table of the first
+ * bytes that may appear next (what a parser can check cheaply).
+ * An ebnf_exception with nothing on the left hand side is taken to
+ * mean "any single character that doesn't start the exception", so
+ * it only shows up in the byte tables.
+ */
+
+#ifndef __EBNF_SETS_HPP__
+#define __EBNF_SETS_HPP__
+
+#include <bitset>
+#include <set>
+#include <unordered_map>
+
+#include "ebnf.hpp"
+
+struct ebnf_object_sets {
+    bool         nullable;      // can match without consuming anything
+    set<string>  first;         // terminals a match may start with
+    bitset<256>  first_bytes;   // bytes a non-empty match may start with
+    set<string>  follow;        // terminals that may come right after a match
+    bitset<256>  follow_bytes;  // bytes that may come right after a match
+    bool         follow_end;    // a match may run to the end of the input
+
+    ebnf_object_sets();
+};
+
+class ebnf_sets {
+    vector<shared_ptr<ebnf_object> > objects;         // every reachable object
+    unordered_map<const ebnf_object *, size_t> index; // object -> slot in objects/sets
+    vector<ebnf_object_sets> sets;
+
+    ebnf_sets();
+    void collect(const shared_ptr<ebnf_object> &object);
+    void compute_first();
+    void compute_follow(const vector<shared_ptr<ebnf_object> > &roots);
+public:
+    static shared_ptr<ebnf_sets> New(const ebnf_grammar &grammar);
+
+    // For what's reachable from roots, each of which may be a start rule
+    static shared_ptr<ebnf_sets> New(const vector<shared_ptr<ebnf_object> > &roots);
+
+    // Every object reachable from the grammar's rules, in discovery order
+    const vector<shared_ptr<ebnf_object> > &reachable() const { return objects; }
+
+    bool contains(const ebnf_object *object) const;
+
+    // object must be reachable from the grammar
+    const ebnf_object_sets &of(const ebnf_object *object) const;
+    const ebnf_object_sets &of(const shared_ptr<ebnf_object> &object) const { return of(object.get()); }
+
+    // FIRST of the sequence items[from..], and whether all of it is nullable
+    bool first_of_sequence(const vector<shared_ptr<ebnf_object> > &items,
+                           size_t from,
+                           set<string> &first,
+                           bitset<256> &first_bytes) const;
+};
+
+#endif // __EBNF_SETS_HPP__
@@ -1,5 +1,954 @@
 #include "ebnf_parser.hpp"
+#include "ebnf_completion.hpp"
+#include "ebnf_lexer.hpp"
+#include "ebnf_writer.hpp"
+#include "ebnf_expression.hpp"
+#include "ebnf_analysis.hpp"
+#include "ebnf_include.hpp"
+#include "ebnf_disk_cache.hpp"
 
+#include <ctype.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what.c_str());
+        failures++;
+    }
+}
+
+// An empty tree to parse text into
+static parse_tree tree_for(const string &name, const string &text) {
+    config_point start(shared_ptr<config_point>(), memory_file::New(name, text));
+    return parse_tree(shared_ptr<ebnf_object>(), start);
+}
+
+static void test_budget() {
+    ebnf_parser parser;
+
+    // rhs is left recursive, so this only stops at the depth limit
+    ebnf_budget budget;
+    auto recursive = tree_for("budget", "a = ;");
+    check(parser.parse_file(recursive, "rule", budget) == -3, "budget: left recursion returns -3");
+    check(budget.exceeded == ebnf_budget::depth_limit, "budget: left recursion hits the depth limit");
+    check((budget.rule_stack.size() >= 2) && (budget.rule_stack[0] == "rule") && (budget.rule_stack[1] == "rhs"),
+          "budget: rule stack shows rule, rhs");
+    check(budget.furthest.byte_offset == 4, "budget: furthest is the ;");
+
+    budget.max_steps = 100;
+    auto steps = tree_for("budget", "numbers = abcdefg;");
+    check(parser.parse_file(steps, "rule", budget) == -3, "budget: step cap returns -3");
+    check((budget.exceeded == ebnf_budget::steps_limit) && (budget.steps == 101), "budget: step cap trips");
+
+    budget.max_steps = 0;
+    budget.max_nodes = 10;
+    auto nodes = tree_for("budget", "numbers = abcdefg;");
+    check(parser.parse_file(nodes, "rule", budget) == -3, "budget: node cap returns -3");
+    check(budget.exceeded == ebnf_budget::nodes_limit, "budget: node cap trips");
+
+    // The same budget again, with nothing left over from last time
+    budget.max_nodes = 0;
+    auto fine = tree_for("budget", "numbers = abcdefg;");
+    check(parser.parse_file(fine, "rule", budget) == 0, "budget: reused budget parses");
+    check((budget.exceeded == ebnf_budget::none) && budget.rule_stack.empty(), "budget: reused budget is reset");
+
+    // { { "x" } } gets an empty round once the inner one has had it all
+    auto grammar = ebnf_grammar::New();
+    grammar->add("list", ebnf_repetition::New(ebnf_repetition::New(ebnf_string::New("x"))));
+    auto list = tree_for("budget", "xx");
+    check(grammar->parse_file(list, "list", budget) == 0, "budget: nullable repetition parses");
+    check((budget.empty_repetitions == 1) && (list.end.byte_offset == 2), "budget: empty repetition is counted");
+}
+
+// item = "x" | list ;  list = "(" , { item } , ")" ;  split in two
+static void test_modules() {
+    auto grammar = ebnf_grammar::New();
+    auto item = ebnf_alternation::New();
+    *item << ebnf_string::New("x") << ebnf_reference::New("list");
+    grammar->add("item", item);
+
+    auto missing = grammar->link();
+    check((missing.size() == 1) && (missing[0] == "list"), "modules: link reports missing rules");
+
+    auto module = ebnf_grammar::New();
+    auto list = ebnf_concatenation::New();
+    *list << ebnf_string::New("(") << ebnf_repetition::New(ebnf_reference::New("item")) << ebnf_string::New(")");
+    module->add("list", list);
+    check(module->link() == vector<string>(1, "item"), "modules: module on its own is missing item");
+
+    auto clash = ebnf_grammar::New();
+    clash->add("item", ebnf_string::New("y"));
+    clash->add("other", ebnf_string::New("z"));
+    check(!grammar->add_module(*clash), "modules: duplicate rule is rejected");
+    check(!grammar->rule("other") && (grammar->rule("item") == item), "modules: rejected module adds nothing");
+
+    // References both ways resolve once it's added
+    check(grammar->add_module(*module), "modules: module is added");
+    check(grammar->link().empty(), "modules: nothing missing");
+    auto tree = tree_for("modules", "(x(x)())");
+    check((grammar->parse_file(tree, "item") == 0) && (tree.end.byte_offset == 8), "modules: item parses through list");
+    tree = tree_for("modules", "(x(x)())");
+    check((grammar->parse_file(tree, "list") == 0) && (tree.end.byte_offset == 8), "modules: list parses through item");
+
+    // Relinked where item is missing, list's reference stops using
+    // the old grammar's item
+    auto other = ebnf_grammar::New();
+    other->add("list", list);
+    check(other->link() == vector<string>(1, "item"), "modules: relink reports missing rules");
+    tree = tree_for("modules", "(x)");
+    check(other->parse_file(tree, "list") == -2, "modules: failed relink unlinks the reference");
+
+    // A rule kept after its grammar is gone can't reach through a
+    // reference into it
+    shared_ptr<ebnf_object> optional;
+    {
+        ebnf_parser parser;
+        optional = parser.rules().find("optional")->second;
+    }
+    ebnf_budget budget;
+    tree = tree_for("modules", "[ a ]");
+    check(!optional->parse(tree, budget), "modules: references into a dropped grammar match nothing");
+    config_point where(shared_ptr<config_point>(), memory_file::New("modules", "[ a ]")), after(where);
+    check(!optional->match(where, after), "modules: references into a dropped grammar don't match");
+}
+
+// config = { "@" , include , ";" | "a" } ;  with the include's path
+// made of letters, digits and "/"
+static shared_ptr<ebnf_grammar> include_grammar(shared_ptr<config_loader> loader,
+                                                shared_ptr<ebnf_parse_cache> cache) {
+    auto path_character = ebnf_alternation::New();
+    for (auto c:string("abcdefghijklmnopqrstuvwxyz0123456789/")) {
+        *path_character << ebnf_string::New(string(1, c));
+    }
+    auto path = ebnf_concatenation::New();
+    *path << path_character << ebnf_repetition::New(path_character);
+
+    auto include_line = ebnf_concatenation::New();
+    *include_line << ebnf_string::New("@")
+                  << ebnf_include::New(path, ebnf_reference::New("config"), loader, cache)
+                  << ebnf_string::New(";");
+    auto item = ebnf_alternation::New();
+    *item << include_line << ebnf_string::New("a");
+
+    auto grammar = ebnf_grammar::New();
+    grammar->add("config", ebnf_repetition::New(item));
+    return grammar;
+}
+
+// Whether all of text matches config
+static bool include_parses(ebnf_grammar &grammar, const string &text) {
+    auto tree = tree_for("top", text);
+    return (grammar.parse_file(tree, "config") == 0) && (tree.end.byte_offset == text.size());
+}
+
+static bool has_error(const ebnf_parse_cache &cache, const string &error) {
+    for (auto &i:cache.errors) {
+        if (i == error) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void test_include() {
+    auto loader = memory_loader::New();
+    auto cache = ebnf_parse_cache::New();
+    auto grammar = include_grammar(loader, cache);
+
+    // The same contents, but @local means something else in each
+    loader->add("dir1/common", "@local;");
+    loader->add("dir2/common", "@local;");
+    loader->add("dir1/local", "a");
+    loader->add("dir2/local", "!!");
+    loader->add("dir1/other", "@local;");
+
+    check(include_parses(*grammar, "@dir1/common;"), "include: relative include");
+    check(!include_parses(*grammar, "@dir2/common;"), "include: bad relative include fails");
+
+    cache->clear();
+    check(!include_parses(*grammar, "@dir1/common;@dir2/common;"), "include: contents are only shared within a directory");
+    check(cache->hits() == 0, "include: no hits across directories");
+    check(has_error(*cache, "dir2/common: dir2/local doesn't match config"), "include: error names the bad file");
+
+    cache->clear();
+    check(include_parses(*grammar, "@dir1/common;@dir1/other;@dir1/common;"), "include: shared includes parse");
+    check((cache->hits() == 2) && (cache->size() == 2), "include: equal contents in a directory are parsed once");
+
+    // A policy change makes different trees, so it can't reuse the old ones
+    cache->clear();
+    check(include_parses(*grammar, "@dir1/common;"), "include: parse before policy change");
+    check(grammar->set_policy("config", ebnf_flatten), "include: set policy");
+    check(include_parses(*grammar, "@dir1/common;"), "include: parse after policy change");
+    check((cache->hits() == 0) && (cache->size() == 4), "include: policy change misses the cache");
+    check(grammar->set_policy("config", ebnf_keep), "include: reset policy");
+    check(include_parses(*grammar, "@dir1/common;"), "include: parse with policy restored");
+    check((cache->hits() == 1) && (cache->size() == 4), "include: restored policy hits the cache");
+
+    // Cycles fail however they're reached, cached or not
+    loader->add("loop1", "a@loop2;");
+    loader->add("loop2", "@loop1;");
+    loader->add("self", "@self;");
+
+    cache->clear();
+    check(!include_parses(*grammar, "@loop1;"), "include: cycle fails");
+    check(has_error(*cache, "loop2: include cycle through loop1"), "include: cycle is reported");
+    check(!include_parses(*grammar, "@loop2;"), "include: cached cycle fails");
+    check(!include_parses(*grammar, "@self;"), "include: self include fails");
+    check(has_error(*cache, "self: include cycle through self"), "include: self include is reported");
+    check(include_parses(*grammar, "a@dir1/common;"), "include: cache still works after cycles");
+}
+
+static bool same_tree(const parse_tree &a, const parse_tree &b) {
+    if ((a.owner != b.owner) || (a.end.byte_offset != b.end.byte_offset) ||
+        (a.end.line_number != b.end.line_number) || (a.children.size() != b.children.size())) {
+        return false;
+    }
+    for (size_t i=0; i<a.children.size(); i++) {
+        if (!same_tree(a.children[i], b.children[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void remove_directory(const string &directory) {
+    DIR *dir = opendir(directory.c_str());
+    if (dir) {
+        while (struct dirent *entry = readdir(dir)) {
+            string name(entry->d_name);
+            if ((name != ".") && (name != "..")) {
+                unlink((directory + "/" + name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(directory.c_str());
+}
+
+static size_t count_nodes(const parse_tree &tree) {
+    size_t count = tree.children.size();
+    for (auto &i:tree.children) {
+        count += count_nodes(i);
+    }
+    return count;
+}
+
+static vector<string> cache_entries(const string &directory) {
+    vector<string> entries;
+    DIR *dir = opendir(directory.c_str());
+    if (dir) {
+        while (struct dirent *entry = readdir(dir)) {
+            string name(entry->d_name);
+            if ((name.size() > 5) && (name.compare(name.size() - 5, 5, ".tree") == 0)) {
+                entries.push_back(directory + "/" + name);
+            }
+        }
+        closedir(dir);
+    }
+    return entries;
+}
+
+// Flip the last byte of a file
+static bool corrupt(const string &path) {
+    FILE *f = fopen(path.c_str(), "r+b");
+    if (!f) {
+        return false;
+    }
+    bool ok = (fseek(f, -1, SEEK_END) == 0);
+    int c = ok ? fgetc(f) : EOF;
+    ok = (c != EOF) && (fseek(f, -1, SEEK_END) == 0) && (fputc(c ^ 0xff, f) != EOF);
+    return (fclose(f) == 0) && ok;
+}
+
+static void test_disk_cache() {
+    char directory[] = "/tmp/sciconf_test_XXXXXX";
+    if (!mkdtemp(directory)) {
+        check(false, "disk cache: mkdtemp");
+        return;
+    }
+    auto cache = ebnf_disk_cache::New(directory);
+    string text = "numbers = abcdefg;";
+
+    ebnf_parser plain;
+    auto expected = tree_for("cached", text);
+    check(plain.parse_file(expected, "rule") == 0, "disk cache: uncached parse");
+
+    ebnf_parser parser;
+    parser.set_disk_cache(cache);
+    auto stored = tree_for("cached", text);
+    check(parser.parse_file(stored, "rule") == 0, "disk cache: first parse");
+    check((cache->stores() == 1) && (cache->hits() == 0), "disk cache: first parse is stored");
+
+    // A hit, with a budget left over from a parse that went over
+    ebnf_budget budget;
+    budget.max_steps = 10;
+    auto over = tree_for("cached", "x = y;");
+    check(parser.parse_file(over, "rule", budget) == -3, "disk cache: budget trips");
+    budget.max_steps = 0;
+
+    auto loaded = tree_for("cached", text);
+    check(parser.parse_file(loaded, "rule", budget) == 0, "disk cache: reload");
+    check(cache->hits() == 1, "disk cache: reload is a hit");
+    check((budget.exceeded == ebnf_budget::none) && budget.rule_stack.empty() && !budget.furthest.file,
+          "disk cache: hit resets the budget");
+
+    // Owners are plain's objects there and parser's here
+    check((loaded.children.size() == 1) && (loaded.children[0].owner == parser.rule("rule")) &&
+          (loaded.end.byte_offset == expected.end.byte_offset) && (loaded.children.size() == expected.children.size()),
+          "disk cache: reloaded tree matches");
+    check(same_tree(stored, loaded), "disk cache: reloaded tree is the stored one");
+
+    // Another instance of the same grammar uses the same entries
+    ebnf_parser fresh;
+    auto fresh_cache = ebnf_disk_cache::New(directory);
+    fresh.set_disk_cache(fresh_cache);
+    auto again = tree_for("cached", text);
+    check(fresh.parse_file(again, "rule") == 0, "disk cache: fresh grammar");
+    check(fresh_cache->hits() == 1, "disk cache: fresh grammar hits");
+    check((again.children.size() == 1) && (again.children[0].owner == fresh.rule("rule")),
+          "disk cache: fresh grammar's tree uses its own rules");
+
+    // A hit is held to the same node and byte limits as a parse
+    ebnf_budget small;
+    small.max_nodes = 5;
+    auto over_nodes = tree_for("cached", text);
+    check(fresh.parse_file(over_nodes, "rule", small) == -3, "disk cache: hit over max_nodes");
+    check((small.exceeded == ebnf_budget::nodes_limit) && over_nodes.children.empty(),
+          "disk cache: hit over max_nodes trips and leaves the tree alone");
+    small.max_nodes = 0;
+    small.max_bytes = 5 * sizeof(parse_tree);
+    auto over_bytes = tree_for("cached", text);
+    check((fresh.parse_file(over_bytes, "rule", small) == -3) && (small.exceeded == ebnf_budget::bytes_limit),
+          "disk cache: hit over max_bytes");
+    small.max_bytes = 0;
+    auto within = tree_for("cached", text);
+    check((fresh.parse_file(within, "rule", small) == 0) && (small.nodes == count_nodes(expected)),
+          "disk cache: hit is charged for its nodes");
+
+    // Damaged entries are rejected and parsed again
+    auto entries = cache_entries(directory);
+    check((entries.size() == 1) && corrupt(entries[0]), "disk cache: corrupt entry");
+    unsigned long rejected = fresh_cache->rejected();
+    auto after_corrupt = tree_for("cached", text);
+    check(fresh.parse_file(after_corrupt, "rule") == 0, "disk cache: parse after corruption");
+    check((fresh_cache->rejected() == rejected + 1) && (fresh_cache->stores() == 1),
+          "disk cache: corrupt entry is rejected and replaced");
+    check(same_tree(after_corrupt, again), "disk cache: parse after corruption is right");
+
+    struct stat info;
+    check((stat(entries[0].c_str(), &info) == 0) && (truncate(entries[0].c_str(), info.st_size - 1) == 0),
+          "disk cache: truncate entry");
+    auto after_truncate = tree_for("cached", text);
+    check(fresh.parse_file(after_truncate, "rule") == 0, "disk cache: parse after truncation");
+    check((fresh_cache->rejected() == rejected + 2) && (fresh_cache->stores() == 2),
+          "disk cache: truncated entry is rejected and replaced");
+    check((truncate(entries[0].c_str(), 16) == 0), "disk cache: truncate header");
+    auto short_header = tree_for("cached", text);
+    check((fresh.parse_file(short_header, "rule") == 0) && (fresh_cache->rejected() == rejected + 3),
+          "disk cache: truncated header is rejected");
+
+    // The same text through a lexer is another entry, and so is the
+    // same text through another lexer
+    string error;
+    auto lexer = ebnf_lexer::New(fresh, { "identifier", "whitespace", "terminal" }, error);
+    auto other_lexer = ebnf_lexer::New(fresh, { "identifier", "whitespace" }, error);
+    check(lexer && other_lexer && (lexer->fingerprint() != other_lexer->fingerprint()),
+          "disk cache: lexers differ");
+    if (lexer && other_lexer) {
+        unsigned long hits = fresh_cache->hits();
+        for (auto l:{ lexer, other_lexer, lexer }) {
+            config_point start(shared_ptr<config_point>(), token_file::New("cached", text, *l));
+            parse_tree tokenized(shared_ptr<ebnf_object>(), start);
+            check(fresh.parse_file(tokenized, "rule") == 0, "disk cache: tokenized parse");
+        }
+        check((fresh_cache->hits() == hits + 1) && (cache_entries(directory).size() == 3),
+              "disk cache: tokenized files have their own entries");
+    }
+
+    remove_directory(directory);
+}
+
+static void find_nodes(const parse_tree &tree, const shared_ptr<ebnf_object> &owner, vector<const parse_tree *> &found) {
+    for (auto &i:tree.children) {
+        if (i.owner == owner) {
+            found.push_back(&i);
+        }
+        find_nodes(i, owner, found);
+    }
+}
+
+static string span_text(const parse_tree &node) {
+    if (node.end.byte_offset < node.start) {
+        return "<bad span>";
+    }
+    const char *data = node.end.file->bytes(node.start, node.end.byte_offset - node.start);
+    return data ? string(data, node.end.byte_offset - node.start) : string();
+}
+
+// Whether every node starts where the one before it ended (or where
+// its parent started), as they always do when nothing is dropped
+static bool contiguous(const parse_tree &tree) {
+    unsigned int at = tree.start;
+    for (auto &i:tree.children) {
+        if ((i.start != at) || !contiguous(i)) {
+            return false;
+        }
+        at = i.end.byte_offset;
+    }
+    return true;
+}
+
+// pair = name , space , "=" , space , name ;
+// name = letter , { letter } ;  letter = "a" | "b" | "c" ;  space = { " " } ;
+static shared_ptr<ebnf_grammar> pair_grammar() {
+    auto letter = ebnf_alternation::New();
+    *letter << ebnf_string::New("a") << ebnf_string::New("b") << ebnf_string::New("c");
+    auto name = ebnf_concatenation::New();
+    *name << letter << ebnf_repetition::New(letter);
+    auto space = ebnf_repetition::New(ebnf_string::New(" "));
+    auto pair = ebnf_concatenation::New();
+    *pair << name << space << ebnf_string::New("=") << space << name;
+
+    auto grammar = ebnf_grammar::New();
+    grammar->add("letter", letter);
+    grammar->add("name", name);
+    grammar->add("space", space);
+    grammar->add("pair", pair);
+    return grammar;
+}
+
+// Nodes under the root for "ab = c", and the spans of the names
+static size_t parse_pair(ebnf_grammar &grammar, vector<string> &names, bool &whole) {
+    auto tree = tree_for("policy", "ab = c");
+    whole = (grammar.parse_file(tree, "pair") == 0) && (tree.end.byte_offset == 6);
+
+    vector<const parse_tree *> found;
+    find_nodes(tree, grammar.rule("name"), found);
+    names.clear();
+    for (auto i:found) {
+        names.push_back(span_text(*i) + "@" + to_string(i->start));
+    }
+    return count_nodes(tree);
+}
+
+static void test_policies() {
+    vector<string> names;
+    vector<string> ab_c = { "ab@0", "c@5" };
+    bool whole;
+
+    // pair(1), name ab(6: letter "a", repetition, letter "b"),
+    // space(2) twice, "="(1), name c(4: the repetition is empty)
+    auto keep = pair_grammar();
+    check(parse_pair(*keep, names, whole) == 16, "policy: keep node count");
+    check(whole && (names == ab_c), "policy: keep spans");
+    auto tree = tree_for("policy", "ab = c");
+    keep->parse_file(tree, "pair");
+    check(contiguous(tree), "policy: kept nodes start where the last ended");
+
+    // Only name's repetition has no name: ab loses 1, c loses 1
+    auto flatten = pair_grammar();
+    flatten->set_inner_policy(ebnf_flatten);
+    check(parse_pair(*flatten, names, whole) == 14, "policy: inner flatten node count");
+    check(whole && (names == ab_c), "policy: inner flatten spans");
+
+    auto collapse = pair_grammar();
+    check(collapse->set_policy("name", ebnf_collapse) && !collapse->set_policy("nothing", ebnf_collapse),
+          "policy: set_policy on rules only");
+    check(parse_pair(*collapse, names, whole) == 8, "policy: collapse node count");
+    check(whole && (names == ab_c), "policy: collapse spans");
+
+    auto drop = pair_grammar();
+    drop->set_policy("space", ebnf_drop);
+    check(parse_pair(*drop, names, whole) == 12, "policy: drop node count");
+    check(whole && (names == ab_c), "policy: drop leaves spans exact");
+
+    // A flattened pair puts its items straight under the root
+    auto flat_pair = pair_grammar();
+    flat_pair->set_policy("pair", ebnf_flatten);
+    tree = tree_for("policy", "ab = c");
+    check((flat_pair->parse_file(tree, "pair") == 0) && (tree.children.size() == 5) &&
+          (tree.children[2].start == 3) && (tree.end.byte_offset == 6), "policy: flattened rule");
+
+    // Failed alternatives and the last round of a repetition come out
+    // again without leaving nodes behind
+    auto rollback = ebnf_grammar::New();
+    auto ab = ebnf_concatenation::New();
+    *ab << ebnf_string::New("a") << ebnf_string::New("b");
+    auto ac = ebnf_concatenation::New();
+    *ac << ebnf_string::New("a") << ebnf_string::New("c");
+    auto choice = ebnf_alternation::New();
+    *choice << ab << ac;
+    rollback->add("choice", choice);
+    rollback->add("list", ebnf_repetition::New(ab));
+    rollback->set_inner_policy(ebnf_flatten);
+
+    tree = tree_for("policy", "ac");
+    check((rollback->parse_file(tree, "choice") == 0) && (tree.children.size() == 1) &&
+          (tree.children[0].children.size() == 2) && (tree.children[0].children[1].start == 1) &&
+          (tree.children[0].end.byte_offset == 2), "policy: failed flattened alternative is rolled back");
+
+    tree = tree_for("policy", "ababa");
+    check((rollback->parse_file(tree, "list") == 0) && (count_nodes(tree) == 5) &&
+          (tree.end.byte_offset == 4), "policy: partial flattened round is rolled back");
+
+    rollback->set_policy("choice", ebnf_collapse);
+    tree = tree_for("policy", "ac");
+    check((rollback->parse_file(tree, "choice") == 0) && (count_nodes(tree) == 1) &&
+          (tree.children[0].end.byte_offset == 2), "policy: collapsed alternation");
+    tree = tree_for("policy", "ad");
+    check((rollback->parse_file(tree, "choice") == -2) && tree.children.empty() &&
+          (tree.end.byte_offset == 0), "policy: failed collapsed alternation leaves nothing");
+
+    // Dropped whitespace doesn't end up in the identifier after it
+    ebnf_parser dropped;
+    dropped.set_policy("whitespace", ebnf_drop);
+    string text = "numbers  =  abc ;";
+    tree = tree_for("policy", text);
+    vector<const parse_tree *> identifiers;
+    check(dropped.parse_file(tree, "rule") == 0, "policy: parse with dropped whitespace");
+    find_nodes(tree, dropped.rule("identifier"), identifiers);
+    check((identifiers.size() == 2) && (span_text(*identifiers[0]) == "numbers") &&
+          (span_text(*identifiers[1]) == "abc"), "policy: identifiers keep their spans");
+
+    // ... and the writer still writes it
+    auto writer = ebnf_writer::New(dropped);
+    check(!writer->replace("whitespace", " "), "policy: no actions on dropped rules");
+    check(writer->replace("identifier", "x"), "policy: actions on other rules");
+    auto out = string_sink::New();
+    writer->write(tree, config_point(shared_ptr<config_point>(), tree.end.file), *out);
+    check(out->text() == "x  =  x ;", "policy: writer copies dropped text");
+
+    // A collapsed rule is written as its source, even if a rule
+    // inside it has an action
+    ebnf_parser collapsed;
+    collapsed.set_policy("rule", ebnf_collapse);
+    tree = tree_for("policy", text);
+    check((collapsed.parse_file(tree, "rule") == 0) && (count_nodes(tree) == 1), "policy: collapsed rule");
+    writer = ebnf_writer::New(collapsed);
+    writer->replace("whitespace", " ");
+    out = string_sink::New();
+    writer->write(tree, config_point(shared_ptr<config_point>(), tree.end.file), *out);
+    check(out->text() == text, "policy: writer copies collapsed matches");
+
+    // Default trees are as they were
+    ebnf_parser plain;
+    tree = tree_for("policy", "numbers = abcdefg;");
+    check((plain.parse_file(tree, "rule") == 0) && (count_nodes(tree) == 56) && contiguous(tree),
+          "policy: default tree");
+}
+
+// More iovecs than one writev takes, with copied text and spans mixed
+// so a batch fills up part way through a copy
+static void test_fd_sink() {
+    FILE *out = tmpfile();
+    if (!out) {
+        check(false, "fd_sink: tmpfile");
+        return;
+    }
+
+    string span(100, 'S');
+    string expected;
+    {
+        shared_ptr<output_sink> sink = fd_sink::New(fileno(out));
+        sink->write("y", 1);
+        expected += "y";
+        for (int i=0; i<3000; i++) {
+            string copied = "<" + to_string(i) + ">";
+            sink->write_span(span.data(), span.size());
+            sink->write(copied);
+            expected += span + copied;
+        }
+        check(sink->flush(), "fd_sink: flush");
+    }
+
+    string written;
+    char buffer[4096];
+    ssize_t length;
+    lseek(fileno(out), 0, SEEK_SET);
+    while ((length = read(fileno(out), buffer, sizeof(buffer))) > 0) {
+        written.append(buffer, length);
+    }
+    fclose(out);
+
+    check(written == expected, "fd_sink: output differs from what was written");
+}
+
+static bool same_completions(const ebnf_completions &a, const ebnf_completions &b) {
+    return (a.terminals == b.terminals) && (a.rules == b.rules) &&
+           (a.bytes == b.bytes) && (a.complete == b.complete);
+}
+
+// What a new completer makes of text
+static ebnf_completions fresh_completions(const ebnf_grammar &grammar, const string &text) {
+    auto completer = ebnf_completer::New(grammar, "rule");
+    completer->feed(text);
+    return completer->completions();
+}
+
+static void test_completion() {
+    ebnf_parser parser;
+    auto completer = ebnf_completer::New(parser, "rule");
+    check(!ebnf_completer::New(parser, "nothing"), "completion: no such rule");
+
+    auto next = completer->completions();
+    check(!next.complete && next.rules.count("rule") && next.rules.count("lhs") &&
+          next.rules.count("identifier") && next.terminals.count("a") && !next.terminals.count("="),
+          "completion: start of a rule");
+
+    check(completer->update("numbers = abc"), "completion: partial rule");
+    next = completer->completions();
+    check(!next.complete, "completion: partial rule isn't complete");
+    check(next.rules == set<string>({ "digit", "letter", "whitespace", "whitespace_character" }),
+          "completion: rules after an identifier");
+    check(next.terminals.count(";") && next.terminals.count(",") && next.terminals.count("|") &&
+          next.terminals.count("_") && next.terminals.count("z") && !next.terminals.count("="),
+          "completion: terminals after an identifier");
+
+    check(completer->update("numbers = abc;") && completer->completions().complete, "completion: whole rule");
+
+    // Only the closing quote fits in a one character terminal
+    check(completer->update("numbers = 'x"), "completion: in a terminal");
+    next = completer->completions();
+    check((next.terminals == set<string>({ "'" })) && (next.bytes.count() == 1), "completion: closing quote");
+
+    // Inside a group the rule can't end yet
+    check(completer->update("numbers = (a|b"), "completion: in a group");
+    next = completer->completions();
+    check(next.terminals.count(")") && next.terminals.count("|") && !next.terminals.count(";") &&
+          (next.rules == set<string>({ "digit", "letter" })), "completion: group needs closing");
+    check(same_completions(next, fresh_completions(parser, "numbers = (a|b")), "completion: update matches feed");
+
+    // A bad edit stops at the last good prefix
+    check(!completer->update("numbers = ab!c"), "completion: bad edit is rejected");
+    check(completer->text() == "numbers = ab", "completion: bad edit rewinds to the good prefix");
+    check(same_completions(completer->completions(), fresh_completions(parser, "numbers = ab")),
+          "completion: rewound state matches feed");
+
+    completer->rewind(3);
+    check((completer->text() == "num") &&
+          same_completions(completer->completions(), fresh_completions(parser, "num")), "completion: rewind");
+
+    // Partly typed literals complete with what's left of them
+    auto words = ebnf_grammar::New();
+    auto word = ebnf_alternation::New();
+    *word << ebnf_string::New("hello") << ebnf_string::New("help");
+    words->add("rule", word);
+    auto typing = ebnf_completer::New(*words, "rule");
+    check(typing->feed("hel") && (typing->completions().terminals == set<string>({ "lo", "p" })),
+          "completion: rest of a partial literal");
+    check(!typing->feed("x") && (typing->text() == "hel"), "completion: feed stops at a bad byte");
+}
+
+// The named nodes of tree as "key start-end", without looking inside
+// tokens (their insides are only there when they weren't tokenized)
+static void named_spans(const parse_tree &tree, const ebnf_lexer &lexer, vector<string> &spans) {
+    for (auto &i:tree.children) {
+        string key = i.owner ? i.owner->key : string();
+        if (!key.empty()) {
+            spans.push_back(key + " " + to_string(i.start) + "-" + to_string(i.end.byte_offset));
+        }
+        bool token = false;
+        for (size_t k=0; k<lexer.kinds(); k++) {
+            token = token || (lexer.kind_name(k) == key);
+        }
+        if (!token) {
+            named_spans(i, lexer, spans);
+        }
+    }
+}
+
+static void test_lexer() {
+    ebnf_parser parser;
+    string error;
+    auto lexer = ebnf_lexer::New(parser, { "identifier", "whitespace", "terminal" }, error);
+    check(lexer && error.empty(), "lexer: builds");
+    if (!lexer) {
+        return;
+    }
+    check(!ebnf_lexer::New(parser, { "rhs" }, error) && !error.empty(), "lexer: recursive rule is refused");
+
+    // Longest match: one identifier, not letters; bytes that start no
+    // token are left out
+    auto file = token_file::New("lexer", "numbers_2 = 'x';", *lexer);
+    vector<string> tokens;
+    for (auto &i:file->token_spans()) {
+        tokens.push_back(lexer->kind_name(i.kind) + " " + to_string(i.start) + "-" + to_string(i.end));
+    }
+    check(tokens == vector<string>({ "identifier 0-9", "whitespace 9-10", "whitespace 11-12", "terminal 12-15" }),
+          "lexer: token kinds and spans");
+
+    // The syntax grammar gives the same tree either way, in far fewer steps
+    auto syntax = lexer->syntax(parser);
+    for (auto text:{ "numbers = 'x';", "numbers = abcdefg;", "long_name =\n  \"c\" ;" }) {
+        string what = string("lexer: \"") + text + "\" ";
+
+        ebnf_budget plain_budget, token_budget;
+        config_point plain_start(shared_ptr<config_point>(), memory_file::New("lexer", text));
+        config_point token_start(shared_ptr<config_point>(), token_file::New("lexer", text, *lexer));
+        parse_tree plain(shared_ptr<ebnf_object>(), plain_start);
+        parse_tree tokenized(shared_ptr<ebnf_object>(), token_start);
+
+        check(syntax->parse_file(plain, "rule", plain_budget) == 0, what + "parses plain");
+        check(syntax->parse_file(tokenized, "rule", token_budget) == 0, what + "parses tokenized");
+
+        vector<string> plain_spans, token_spans;
+        named_spans(plain, *lexer, plain_spans);
+        named_spans(tokenized, *lexer, token_spans);
+        check(!plain_spans.empty() && (plain_spans == token_spans), what + "trees match");
+        check(token_budget.steps * 10 < plain_budget.steps, what + "tokenized takes fewer steps");
+    }
+
+    // A bare exception is one byte that can't start it, both ways
+    auto quoted = ebnf_concatenation::New();
+    *quoted << ebnf_string::New("<") << ebnf_exception::New(ebnf_string::New("ab")) << ebnf_string::New(">");
+    auto grammar = ebnf_grammar::New();
+    grammar->add("quoted", quoted);
+    auto quoted_lexer = ebnf_lexer::New(*grammar, { "quoted" }, error);
+    check(!!quoted_lexer, "lexer: bare exception compiles");
+    if (!quoted_lexer) {
+        return;
+    }
+    for (auto text:{ "<c>", "<a>", "<b>" }) {
+        auto tree = tree_for("lexer", text);
+        bool parsed = (grammar->parse_file(tree, "quoted") == 0);
+        bool lexed = (token_file::New("lexer", text, *quoted_lexer)->token_spans().size() == 1);
+        check(parsed == lexed, string("lexer: exception agrees on ") + text);
+        check(parsed == (text[1] != 'a'), string("lexer: exception on ") + text);
+    }
+}
+
+// list = name , { sep , name } ;  sep = ", " ;  name = letter , { letter } ;
+static shared_ptr<ebnf_grammar> list_grammar() {
+    auto letter = ebnf_alternation::New();
+    for (auto c:string("abcdefghijklmnopqrstuvwxyz")) {
+        *letter << ebnf_string::New(string(1, c));
+    }
+    auto name = ebnf_concatenation::New();
+    *name << letter << ebnf_repetition::New(letter);
+    auto sep = ebnf_string::New(", ");
+    auto more = ebnf_concatenation::New();
+    *more << sep << name;
+    auto list = ebnf_concatenation::New();
+    *list << name << ebnf_repetition::New(more);
+
+    auto grammar = ebnf_grammar::New();
+    grammar->add("name", name);
+    grammar->add("sep", sep);
+    grammar->add("list", list);
+    return grammar;
+}
+
+static string written(ebnf_grammar &grammar, ebnf_writer &writer, const string &text) {
+    auto tree = tree_for("writer", text);
+    if (grammar.parse_file(tree, "list") != 0) {
+        return "<no parse>";
+    }
+    auto out = string_sink::New();
+    writer.write(tree, config_point(shared_ptr<config_point>(), tree.end.file), *out);
+    return out->text();
+}
+
+static void test_writer() {
+    auto grammar = list_grammar();
+    grammar->set_inner_policy(ebnf_flatten);
+
+    auto writer = ebnf_writer::New(*grammar);
+    check(written(*grammar, *writer, "c, a, b") == "c, a, b", "writer: unchanged");
+    check(!writer->sort("nothing"), "writer: no such rule");
+
+    auto upper = [](ebnf_writer &w, const parse_tree &node, const config_point &start, output_sink &sink) {
+        string text = w.source(node, start);
+        for (auto &c:text) {
+            c = toupper(c);
+        }
+        sink.write(text);
+    };
+    check(writer->format("name", upper), "writer: format");
+    check(written(*grammar, *writer, "c, a, b") == "C, A, B", "writer: formatted");
+
+    // Separators are children too while they're in the tree
+    writer = ebnf_writer::New(*grammar);
+    writer->sort("list");
+    check(written(*grammar, *writer, "c, ab, b") == ", , abbc", "writer: sorted with separators");
+
+    // ... and stay where they were once they're dropped
+    grammar->set_policy("sep", ebnf_drop);
+    writer = ebnf_writer::New(*grammar);
+    writer->sort("list");
+    check(written(*grammar, *writer, "c, a, b") == "a, b, c", "writer: sorted");
+    check(written(*grammar, *writer, "c, ab, b") == "ab, b, c", "writer: sorted by text");
+
+    // Children are sorted by what they're written as
+    writer->format("name", upper);
+    check(written(*grammar, *writer, "b, a, c") == "A, B, C", "writer: sorted and formatted");
+
+    // Replacing copies nothing from the match
+    writer = ebnf_writer::New(*grammar);
+    writer->replace("name", "x");
+    check(written(*grammar, *writer, "c, a, b") == "x, x, x", "writer: replaced");
+}
+
+// Whether text fails to load or compile, with error among the reasons
+static bool expressions_fail(const string &text, const string &error) {
+    auto expressions = ebnf_expressions::New();
+    bool ok = expressions->load("expressions", text) && expressions->compile();
+    for (auto &i:expressions->errors) {
+        if (i == error) {
+            return !ok;
+        }
+    }
+    return false;
+}
+
+static void test_expressions() {
+    check(expressions_fail("x = 1 m + 1 s", "x: can't add m and s in \"1 m + 1 s\""),
+          "expressions: unit mismatch");
+    check(expressions_fail("x = [1, 2] + [1, 2, 3]", "x: arrays of different lengths (2 and 3) in \"[1, 2] + [1, 2, 3]\""),
+          "expressions: array length mismatch");
+    check(expressions_fail("x = [1 m, 2 s]", "x: array elements need to be numbers in the same units in \"[1 m, 2 s]\""),
+          "expressions: array of mixed units");
+    check(expressions_fail("x = 3 furlongs", "x: don't know what furlongs is in \"furlongs\""),
+          "expressions: unknown unit");
+    check(expressions_fail("x = frob(2)", "x: there's no function called frob"),
+          "expressions: unknown function");
+    check(expressions_fail("a = b + 1\nb = a * 2", "b: a and b are defined in terms of each other") &&
+          expressions_fail("a = b + 1\nb = a * 2", "a: uses b, which has errors"),
+          "expressions: definitions in terms of each other");
+    check(expressions_fail("x = 1\nx = 2", "x is already defined"), "expressions: duplicate definition");
+    check(expressions_fail("x = sqrt(1 m)", "x: can't take the square root of m in \"sqrt(1 m)\""),
+          "expressions: sqrt of an odd dimension");
+
+    auto expressions = ebnf_expressions::New();
+    check(expressions->parameter("n", "km"), "expressions: parameter");
+    check(expressions->load("expressions", "area = sqrt(4 m^2) * 3 m\n"
+                                           "scaled = n * (2 * 3)\n"
+                                           "unfolded = n * 6\n"
+                                           "total = scaled + area / (1 m)\n"), "expressions: load");
+    check(expressions->compile(), "expressions: compile");
+
+    // Whatever doesn't depend on n is worked out once, when compiled
+    uint32_t area = expressions->id("area"), scaled = expressions->id("scaled"), total = expressions->id("total");
+    check(expressions->constant(area) && (expressions->instructions(area) == 0), "expressions: constant is folded");
+    check(expressions->value(area) && (expressions->value(area)->text() == "6 m^2"), "expressions: folded value");
+    check(!expressions->constant(scaled) && !expressions->constant(total), "expressions: parameters aren't folded");
+    check(expressions->instructions(scaled) == expressions->instructions(expressions->id("unfolded")),
+          "expressions: constant parts of a definition are folded");
+    check(!expressions->value(total), "expressions: no value until the parameter is set");
+
+    // Worked out again after a set() it uses, and only then
+    check(expressions->set("n", 2), "expressions: set");
+    unsigned long evaluations = expressions->evaluations();
+    const ebnf_value *value = expressions->value(total);
+    check(value && (value->number() == 12006), "expressions: value after set");
+    unsigned long after_first = expressions->evaluations();
+    check(after_first > evaluations, "expressions: set makes it evaluate");
+    value = expressions->value(total);
+    check(value && (value->number() == 12006) && (expressions->evaluations() == after_first),
+          "expressions: value is cached");
+    check(expressions->value(area) && (expressions->evaluations() == after_first),
+          "expressions: constants don't evaluate");
+    check(expressions->set("n", 3), "expressions: set again");
+    value = expressions->value(total);
+    check(value && (value->number() == 18006) && (expressions->evaluations() > after_first),
+          "expressions: value is recomputed after set");
+    check(!expressions->set("area", 1) && !expressions->set("n", vector<double>(2, 1.0)),
+          "expressions: only parameters, with the right length, can be set");
+}
+
+// The one finding of kind in rule, or 0
+static const ebnf_finding *finding(const ebnf_analysis &analysis, ebnf_finding::kind_t kind, const string &rule) {
+    const ebnf_finding *rv = 0;
+    for (auto &i:analysis.findings()) {
+        if ((i.kind == kind) && (i.rule == rule)) {
+            if (rv) {
+                return 0;
+            }
+            rv = &i;
+        }
+    }
+    return rv;
+}
+
+static bool only_finding(const ebnf_grammar &grammar, ebnf_finding::kind_t kind, const string &rule, ebnf_finding::cost_t cost) {
+    auto analysis = ebnf_analysis::New(grammar);
+    auto f = finding(*analysis, kind, rule);
+    return f && (f->cost == cost) && (analysis->findings().size() == 1);
+}
+
+static void test_analysis() {
+    // rhs reaches itself through its first alternatives, and two of
+    // them start with rhs
+    ebnf_parser parser;
+    auto analysis = ebnf_analysis::New(parser);
+    auto recursion = finding(*analysis, ebnf_finding::left_recursion, "rhs");
+    auto overlap = finding(*analysis, ebnf_finding::first_overlap, "rhs");
+    check(recursion && (recursion->cost == ebnf_finding::unbounded), "analysis: left recursion on rhs");
+    check(overlap && (overlap->cost == ebnf_finding::exponential), "analysis: nested overlap in rhs is exponential");
+    check((analysis->findings().size() == 2) && (analysis->worst() == ebnf_finding::unbounded), "analysis: ebnf_parser's findings");
+
+    // op = "<" | "<=" ;
+    auto shadowed = ebnf_grammar::New();
+    auto op = ebnf_alternation::New();
+    *op << ebnf_string::New("<") << ebnf_string::New("<=");
+    shadowed->add("op", op);
+    check(only_finding(*shadowed, ebnf_finding::shadowed_alternative, "op", ebnf_finding::constant), "analysis: \"<=\" is shadowed");
+
+    // maybe = "" | "x" ;
+    auto infallible = ebnf_grammar::New();
+    auto maybe = ebnf_alternation::New();
+    *maybe << ebnf_string::New("") << ebnf_string::New("x");
+    infallible->add("maybe", maybe);
+    check(only_finding(*infallible, ebnf_finding::shadowed_alternative, "maybe", ebnf_finding::constant),
+          "analysis: \"\" always matches");
+
+    // nested = { { "x" } } ;
+    auto nullable = ebnf_grammar::New();
+    nullable->add("nested", ebnf_repetition::New(ebnf_repetition::New(ebnf_string::New("x"))));
+    check(only_finding(*nullable, ebnf_finding::nullable_repetition, "nested", ebnf_finding::constant),
+          "analysis: nested nullable repetition");
+
+    // ab = "a" , "b" | "a" , "c" ;  only a byte is parsed again
+    auto overlapping = ebnf_grammar::New();
+    auto ab = ebnf_concatenation::New(), ac = ebnf_concatenation::New();
+    *ab << ebnf_string::New("a") << ebnf_string::New("b");
+    *ac << ebnf_string::New("a") << ebnf_string::New("c");
+    auto either = ebnf_alternation::New();
+    *either << ab << ac;
+    overlapping->add("ab", either);
+    check(only_finding(*overlapping, ebnf_finding::first_overlap, "ab", ebnf_finding::constant), "analysis: short FIRST overlap");
+
+    // sum = sum , "+" | "x" ;  recursion, and any amount parsed again
+    auto recursive = ebnf_grammar::New();
+    auto plus = ebnf_concatenation::New();
+    *plus << ebnf_reference::New("sum") << ebnf_string::New("+");
+    auto sum = ebnf_alternation::New();
+    *sum << plus << ebnf_string::New("x");
+    recursive->add("sum", sum);
+    recursive->link();
+    analysis = ebnf_analysis::New(*recursive);
+    recursion = finding(*analysis, ebnf_finding::left_recursion, "sum");
+    overlap = finding(*analysis, ebnf_finding::first_overlap, "sum");
+    check(recursion && (recursion->cost == ebnf_finding::unbounded) && overlap &&
+          (overlap->cost == ebnf_finding::polynomial) && (analysis->findings().size() == 2),
+          "analysis: left recursion on sum");
+
+    // letter = "a" | "b" ;  word = letter , { letter } ;
+    auto clean = ebnf_grammar::New();
+    auto letter = ebnf_alternation::New();
+    *letter << ebnf_string::New("a") << ebnf_string::New("b");
+    auto word = ebnf_concatenation::New();
+    *word << ebnf_reference::New("letter") << ebnf_repetition::New(ebnf_reference::New("letter"));
+    clean->add("letter", letter);
+    clean->add("word", word);
+    clean->link();
+    analysis = ebnf_analysis::New(*clean);
+    check(analysis->findings().empty() && (analysis->worst() == ebnf_finding::constant), "analysis: clean grammar");
+}
 
 int main() {
     auto file(memory_file::New("test1", "numbers = abcdefg;"));
@@ -15,4 +964,71 @@ int main() {
     int rv = parser.parse_file(pt, "rule");
     
     printf("Result: %d\n", rv);
+
+    // Write it back out in canonical form
+    auto writer = ebnf_writer::New(parser);
+    writer->replace("whitespace", " ");
+
+    auto canonical = string_sink::New();
+    writer->write(pt, cp, *canonical);
+    printf("Canonical: %s\n", canonical->text().c_str());
+
+    // Same thing, with the lexical rules run through a lexer first
+    string error;
+    vector<string> tokens = { "identifier", "whitespace", "terminal" };
+    auto lexer = ebnf_lexer::New(parser, tokens, error);
+    if (!lexer) {
+        printf("Lexer: %s\n", error.c_str());
+        return 1;
+    }
+    auto syntax = lexer->syntax(parser);
+
+    config_point token_cp(parent, token_file::New("test1", "numbers = abcdefg;", *lexer));
+    parse_tree token_pt(shared_ptr<ebnf_object>(0), token_cp);
+
+    printf("Tokenized result: %d\n", syntax->parse_file(token_pt, "rule"));
+
+    // What could come next after a partial rule?
+    auto completer = ebnf_completer::New(parser, "rule");
+    completer->update("numbers = abc");
+
+    auto next = completer->completions();
+    printf("Completions after \"%s\":", completer->text().c_str());
+    for (auto &i:next.rules) {
+        printf(" %s", i.c_str());
+    }
+    printf("\n");
+
+    // Hot spots in the grammar itself
+    auto analysis = ebnf_analysis::New(parser);
+    printf("Analysis: %zu findings, worst %s\n", analysis->findings().size(),
+           ebnf_finding::cost_name(analysis->worst()));
+
+    // Derived values with units
+    auto expressions = ebnf_expressions::New();
+    expressions->parameter("steps", "");
+    expressions->load("test2", "dt = 1 ms / steps\nspan = [1, 2, 3] * 2 km\n");
+    if (!expressions->compile()) {
+        printf("Expressions: %s\n", expressions->errors[0].c_str());
+        return 1;
+    }
+    expressions->set("steps", 1000);
+    printf("dt = %s, span = %s\n",
+           expressions->value("dt")->text().c_str(),
+           expressions->value("span")->text().c_str());
+
+    test_fd_sink();
+    test_completion();
+    test_lexer();
+    test_writer();
+    test_expressions();
+    test_analysis();
+    test_budget();
+    test_modules();
+    test_include();
+    test_disk_cache();
+    test_policies();
+
+    printf("Checks: %s\n", failures ? (to_string(failures) + " failed").c_str() : "passed");
+    return failures ? 1 : 0;
 }
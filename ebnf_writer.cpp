@@ -0,0 +1,409 @@
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ebnf_writer.hpp"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static const size_t fd_sink_block_size   = 64 * 1024;   // copied text storage
+static const size_t fd_sink_copy_below   = 64;          // shorter spans are copied
+static const size_t fd_sink_flush_at     = 1024 * 1024; // bytes gathered before a writev
+
+//
+// string_sink
+//
+
+string_sink::string_sink() {
+}
+
+shared_ptr<string_sink> string_sink::New() {
+    return shared_ptr<string_sink>(new string_sink());
+}
+
+void string_sink::write_span(const char *data, size_t length) {
+    _text.append(data, length);
+}
+
+void string_sink::write(const char *data, size_t length) {
+    _text.append(data, length);
+}
+
+bool string_sink::flush() {
+    return true;
+}
+
+//
+// fd_sink
+//
+
+fd_sink::fd_sink(int _fd):fd(_fd), failed(false), pending_bytes(0), block_used(0) {
+}
+
+fd_sink::~fd_sink() {
+    flush();
+}
+
+shared_ptr<fd_sink> fd_sink::New(int fd) {
+    return shared_ptr<fd_sink>(new fd_sink(fd));
+}
+
+void fd_sink::add(const char *data, size_t length) {
+    if (!pending.empty()) {
+        auto &last(pending.back());
+        if ((const char *)last.iov_base + last.iov_len == data) {
+            last.iov_len += length; // contiguous with what's already queued
+            pending_bytes += length;
+            return;
+        }
+    }
+
+    struct iovec v;
+    v.iov_base = (void *)data;
+    v.iov_len  = length;
+    pending.push_back(v);
+    pending_bytes += length;
+}
+
+void fd_sink::write_span(const char *data, size_t length) {
+    if (!length) {
+        return;
+    }
+    if (length < fd_sink_copy_below) {
+        write(data, length);
+        return;
+    }
+    if (pending.size() >= IOV_MAX) {
+        flush();
+    }
+    add(data, length);
+    if (pending_bytes >= fd_sink_flush_at) {
+        flush();
+    }
+}
+
+void fd_sink::write(const char *data, size_t length) {
+    while (length) {
+        // Here rather than in add(), which would start the block over
+        // under the text we're about to queue
+        if (pending.size() >= IOV_MAX) {
+            flush();
+        }
+        if (blocks.empty() || (block_used == blocks.back()->size())) {
+            if (pending_bytes >= fd_sink_flush_at) {
+                flush(); // lets us reuse the blocks
+            }
+            if (blocks.empty() || (block_used == blocks.back()->size())) {
+                blocks.push_back(shared_ptr<vector<char> >(new vector<char>(fd_sink_block_size)));
+                block_used = 0;
+            }
+        }
+
+        auto &block(*blocks.back());
+        size_t size = min(length, block.size() - block_used);
+        memcpy(&block[block_used], data, size);
+        add(&block[block_used], size);
+
+        block_used += size;
+        data       += size;
+        length     -= size;
+    }
+}
+
+bool fd_sink::flush() {
+    size_t first = 0;
+
+    while (!failed && (first < pending.size())) {
+        int count = (int)min(pending.size() - first, (size_t)IOV_MAX);
+        ssize_t written = writev(fd, &pending[first], count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failed = true;
+            break;
+        }
+
+        // skip what went out, and trim a partly written iovec
+        while ((first < pending.size()) && (written >= (ssize_t)pending[first].iov_len)) {
+            written -= pending[first].iov_len;
+            first++;
+        }
+        if (written) {
+            pending[first].iov_base = (char *)pending[first].iov_base + written;
+            pending[first].iov_len -= written;
+        }
+    }
+
+    pending.clear();
+    pending_bytes = 0;
+
+    // keep one block around for the next batch
+    if (blocks.size() > 1) {
+        blocks.erase(blocks.begin(), blocks.end()-1);
+    }
+    block_used = 0;
+
+    return !failed;
+}
+
+//
+// ebnf_writer
+//
+
+ebnf_writer::ebnf_writer(const ebnf_grammar &grammar):rules(grammar.rules()), prepared(false), span_start(0), span_end(0) {
+}
+
+shared_ptr<ebnf_writer> ebnf_writer::New(const ebnf_grammar &grammar) {
+    return shared_ptr<ebnf_writer>(new ebnf_writer(grammar));
+}
+
+bool ebnf_writer::set_action(const string &rule, const action &a) {
+    auto found = rules.find(rule);
+    if ((found == rules.end()) || (found->second->policy == ebnf_drop)) {
+        return false;
+    }
+    actions[found->second.get()] = a;
+    prepared = false;
+    return true;
+}
+
+bool ebnf_writer::replace(const string &rule, const string &text) {
+    action a;
+    a.kind = action::replace;
+    a.text = text;
+    return set_action(rule, a);
+}
+
+bool ebnf_writer::format(const string &rule, formatter with) {
+    action a;
+    a.kind = action::format;
+    a.format_with = with;
+    return set_action(rule, a);
+}
+
+bool ebnf_writer::sort(const string &rule) {
+    action a;
+    a.kind = action::sort;
+    return set_action(rule, a);
+}
+
+// Work out which objects can't have an action anywhere beneath them,
+// so their matches can be copied without looking inside
+
+void ebnf_writer::prepare() {
+    vector<shared_ptr<ebnf_object> > objects;
+    unordered_map<const ebnf_object *, vector<const ebnf_object *> > children;
+
+    vector<shared_ptr<ebnf_object> > pending;
+    for (auto &i:rules) {
+        pending.push_back(i.second);
+    }
+    while (!pending.empty()) {
+        auto object = pending.back();
+        pending.pop_back();
+        if (!object || children.count(object.get())) {
+            continue;
+        }
+        ebnf_children visitor;
+        object->accept(visitor);
+
+        auto &list(children[object.get()]);
+        for (auto &i:visitor.children) {
+            list.push_back(i.get());
+            pending.push_back(i);
+        }
+        objects.push_back(object);
+    }
+
+    verbatim.clear();
+    for (auto &i:objects) {
+        verbatim[i.get()] = !actions.count(i.get());
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto &i:objects) {
+            if (!verbatim[i.get()]) {
+                continue;
+            }
+            for (auto child:children[i.get()]) {
+                if (!verbatim[child]) {
+                    verbatim[i.get()] = false;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    prepared = true;
+}
+
+bool ebnf_writer::extend_span(const config_point &start, const config_point &end, output_sink &sink) {
+    if ((span_file == start.file) && (span_end == start.byte_offset)) {
+        span_end = end.byte_offset;
+        return true;
+    }
+    if (!flush_span(sink)) {
+        return false;
+    }
+    span_file  = start.file;
+    span_start = start.byte_offset;
+    span_end   = end.byte_offset;
+    return true;
+}
+
+bool ebnf_writer::flush_span(output_sink &sink) {
+    if (!span_file) {
+        return true;
+    }
+
+    bool ok = true;
+    if (span_end > span_start) {
+        const char *data = span_file->bytes(span_start, span_end - span_start);
+        if (data) {
+            sink.write_span(data, span_end - span_start);
+        } else {
+            ok = false;
+        }
+    }
+    span_file.reset();
+    return ok;
+}
+
+// Moves point on to offset in its file, counting lines on the way
+static void skip_to(config_point &point, unsigned int offset) {
+    const char *data = point.file->bytes(point.byte_offset, offset - point.byte_offset);
+    if (!data) {
+        point.byte_offset = offset;
+        return;
+    }
+    for (const char *end = data + (offset - point.byte_offset); data < end; data++) {
+        if (*data == '\n') {
+            point.cr();
+        } else {
+            point.advance();
+        }
+    }
+}
+
+bool ebnf_writer::emit(const parse_tree &node, const config_point &start, output_sink &sink) {
+    // Text dropped from the tree before it is copied as it is
+    if (node.start > start.byte_offset) {
+        config_point node_start(start);
+        skip_to(node_start, node.start);
+        return extend_span(start, node_start, sink) && emit(node, node_start, sink);
+    }
+
+    if (node.owner) {
+        auto found = actions.find(node.owner.get());
+        if (found != actions.end()) {
+            if (!flush_span(sink)) {
+                return false;
+            }
+            auto &a(found->second);
+            switch (a.kind) {
+                case action::replace:
+                    sink.write(a.text);
+                    return true;
+                case action::format:
+                    a.format_with(*this, node, start, sink);
+                    return true;
+                case action::sort:
+                    break;
+            }
+
+            // Only the children's own text is sorted: what was
+            // dropped between them stays where it was
+            vector<string> children;
+            vector<pair<config_point, config_point> > gaps;
+            config_point child_start(start);
+            for (auto &i:node.children) {
+                config_point own_start(child_start);
+                skip_to(own_start, i.start);
+                gaps.push_back(make_pair(child_start, own_start));
+                children.push_back(text(i, own_start));
+                child_start = i.end;
+            }
+            std::sort(children.begin(), children.end());
+            for (size_t i=0; i<children.size(); i++) {
+                if (!extend_span(gaps[i].first, gaps[i].second, sink) || !flush_span(sink)) {
+                    return false;
+                }
+                sink.write(children[i]);
+            }
+            return extend_span(child_start, node.end, sink);
+        }
+
+        auto quick = verbatim.find(node.owner.get());
+        if ((quick != verbatim.end()) && quick->second) {
+            return extend_span(start, node.end, sink);
+        }
+    }
+
+    config_point child_start(start);
+    for (auto &i:node.children) {
+        if (!emit(i, child_start, sink)) {
+            return false;
+        }
+        child_start = i.end;
+    }
+
+    // Whatever's left has no nodes (dropped, or a collapsed match)
+    if (node.end.byte_offset > child_start.byte_offset) {
+        return extend_span(child_start, node.end, sink);
+    }
+    return true;
+}
+
+bool ebnf_writer::write(const parse_tree &tree, const config_point &start, output_sink &sink) {
+    if (!prepared) {
+        prepare();
+    }
+
+    // Formatters may call back in here; spans are always flushed
+    // before a formatter runs, so there's nothing pending to mix up
+    bool ok = emit(tree, start, sink);
+    return flush_span(sink) && ok;
+}
+
+string ebnf_writer::source(const parse_tree &node, const config_point &start) {
+    if (node.end.byte_offset <= start.byte_offset) {
+        return string();
+    }
+    unsigned int length = node.end.byte_offset - start.byte_offset;
+    const char *data = start.file->bytes(start.byte_offset, length);
+    if (!data) {
+        return string();
+    }
+    return string(data, length);
+}
+
+string ebnf_writer::text(const parse_tree &node, const config_point &start) {
+    auto sink = string_sink::New();
+
+    // Sorting needs each child as a string, but the child's own text
+    // still goes through the actions, hence the separate span
+    auto saved_file  = span_file;
+    auto saved_start = span_start;
+    auto saved_end   = span_end;
+    span_file.reset();
+
+    if (!prepared) {
+        prepare();
+    }
+    emit(node, start, *sink);
+    flush_span(*sink);
+
+    span_file  = saved_file;
+    span_start = saved_start;
+    span_end   = saved_end;
+
+    return sink->text();
+}
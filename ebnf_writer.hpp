@@ -0,0 +1,143 @@
+/*
+ * Writing parse trees back out
+ *
+ * This covers "reformat an input in a canonical order and format"
+ * and "load a config file from one format and output to another".
+ * An ebnf_writer walks a parse_tree and, rule by rule, either copies
+ * the matched text straight out of the source config_file, replaces
+ * it with fixed text (say, whitespace with a single space), hands it
+ * to a formatter (translating to another format), or sorts the
+ * children of the match into a canonical order.
+ *
+ * Unchanged text is never turned into strings: the writer knows which
+ * grammar objects can't contain a rule with an action, skips over
+ * their subtrees entirely, and merges neighbouring unchanged matches
+ * into one span that points into the source file.  Spans and copied
+ * text go to an output_sink; fd_sink gathers them into an iovec list
+ * and hands them to writev in large batches.
+ *
+ * Text the tree doesn't have nodes for is copied as it is: what
+ * dropped rules matched, and what's inside a collapsed match (so
+ * actions on rules inside one don't apply, though one on the
+ * collapsed rule itself does).  Actions can't be set on dropped rules.
+ */
+
+#ifndef __EBNF_WRITER_HPP__
+#define __EBNF_WRITER_HPP__
+
+#include <functional>
+#include <unordered_map>
+#include <sys/uio.h>
+
+#include "ebnf.hpp"
+
+//
+// Where written text goes
+//
+class output_sink {
+public:
+    virtual ~output_sink() {};
+
+    // data is not copied and must stay valid until flush()
+    virtual void write_span(const char *data, size_t length)=0;
+
+    // data is copied
+    virtual void write(const char *data, size_t length)=0;
+    void write(const string &text) { write(text.data(), text.size()); }
+
+    virtual bool flush()=0;
+};
+
+// Collects everything into a string
+class string_sink:public output_sink {
+    string _text;
+    string_sink();
+public:
+    virtual ~string_sink() {};
+
+    static shared_ptr<string_sink> New();
+
+    virtual void write_span(const char *data, size_t length);
+    virtual void write(const char *data, size_t length);
+    virtual bool flush();
+
+    const string &text() const { return _text; }
+};
+
+// Gathers spans into iovecs and writes them to a file descriptor
+// with writev.  Short pieces are copied into a buffer instead, so
+// they don't each cost an iovec.
+class fd_sink:public output_sink {
+    int fd;
+    bool failed;
+    vector<struct iovec> pending;
+    size_t pending_bytes;
+    vector<shared_ptr<vector<char> > > blocks; // storage for copied text
+    size_t block_used;                         // bytes used in blocks.back()
+
+    fd_sink(int fd);
+    void add(const char *data, size_t length); // callers make room in pending first
+public:
+    virtual ~fd_sink();
+
+    static shared_ptr<fd_sink> New(int fd);
+
+    virtual void write_span(const char *data, size_t length);
+    virtual void write(const char *data, size_t length);
+    virtual bool flush();
+};
+
+//
+// The writer
+//
+class ebnf_writer {
+public:
+    // Writes node (which matched starting at start) to sink
+    typedef function<void(ebnf_writer &writer,
+                          const parse_tree &node,
+                          const config_point &start,
+                          output_sink &sink)> formatter;
+
+private:
+    struct action {
+        enum kind_t { replace, format, sort } kind;
+        string text;
+        formatter format_with;
+    };
+
+    map<string, shared_ptr<ebnf_object> > rules;
+    unordered_map<const ebnf_object *, action> actions;
+    unordered_map<const ebnf_object *, bool> verbatim; // nothing under it has an action
+    bool prepared;
+
+    // unchanged text not handed to the sink yet
+    shared_ptr<config_file> span_file;
+    unsigned int span_start, span_end;
+
+    ebnf_writer(const ebnf_grammar &grammar);
+    bool set_action(const string &rule, const action &a);
+    void prepare();
+    bool emit(const parse_tree &node, const config_point &start, output_sink &sink);
+    bool extend_span(const config_point &start, const config_point &end, output_sink &sink);
+    bool flush_span(output_sink &sink);
+public:
+    static shared_ptr<ebnf_writer> New(const ebnf_grammar &grammar);
+
+    // Each returns false if there's no such rule, or it's dropped from
+    // trees (see ebnf_tree_policy)
+    bool replace(const string &rule, const string &text);  // write text instead of the match
+    bool format(const string &rule, formatter with);       // let with write the match
+    bool sort(const string &rule);                         // write the children in sorted order
+                                                           // (dropped text between them stays put)
+
+    // Write tree, which matched starting at start.  Returns false if
+    // the source file couldn't give us the text.
+    bool write(const parse_tree &tree, const config_point &start, output_sink &sink);
+
+    // For formatters: the text a node matched, as it is in the file
+    // and as this writer would write it
+    string source(const parse_tree &node, const config_point &start);
+    string text(const parse_tree &node, const config_point &start);
+};
+
+#endif // __EBNF_WRITER_HPP__
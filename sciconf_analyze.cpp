@@ -0,0 +1,114 @@
+/*
+ * sciconf-analyze: report the performance hazards in grammars
+ *
+ *   sciconf-analyze [-s] [-f cost] [grammar ...]
+ *
+ * Grammars are built in code, so this knows the ones that come with
+ * sciconf by name ("ebnf" and "expression", all of them by default).
+ * A grammar of your own is checked the same way:  hand it to
+ * ebnf_analysis::New and look at the findings.
+ *
+ *   -s       also print the nullable/FIRST/FOLLOW sets of each rule
+ *   -f cost  exit with 1 if anything costs this much or more
+ *            (constant, linear, polynomial, exponential, unbounded;
+ *            exponential by default)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ebnf_analysis.hpp"
+#include "ebnf_parser.hpp"
+#include "ebnf_expression.hpp"
+
+static shared_ptr<ebnf_grammar> grammar_named(const string &name) {
+    if (name == "ebnf") {
+        return shared_ptr<ebnf_grammar>(new ebnf_parser());
+    }
+    if (name == "expression") {
+        return shared_ptr<ebnf_grammar>(new ebnf_expression_grammar());
+    }
+    return shared_ptr<ebnf_grammar>();
+}
+
+static void print_sets(const ebnf_grammar &grammar, const ebnf_sets &sets) {
+    for (auto &i:grammar.rules()) {
+        auto &s(sets.of(i.second));
+        printf("  %s%s\n", i.first.c_str(), s.nullable ? " (nullable)" : "");
+        printf("      first:  %s\n", ebnf_bytes_text(s.first_bytes).c_str());
+        printf("      follow: %s%s%s\n", ebnf_bytes_text(s.follow_bytes).c_str(),
+               (s.follow_end && s.follow_bytes.any()) ? " " : "",
+               s.follow_end ? "end" : "");
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "usage: sciconf-analyze [-s] [-f cost] [grammar ...]\n"
+                    "grammars: ebnf expression\n"
+                    "costs: constant linear polynomial exponential unbounded\n");
+}
+
+int main(int argc, char **argv) {
+    bool show_sets = false;
+    ebnf_finding::cost_t fail_at = ebnf_finding::exponential;
+    vector<string> names;
+
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-s")) {
+            show_sets = true;
+        } else if (!strcmp(argv[i], "-f") && (i+1 < argc)) {
+            bool known = false;
+            for (int c=ebnf_finding::constant; c<=ebnf_finding::unbounded; c++) {
+                if (!strcmp(argv[i+1], ebnf_finding::cost_name((ebnf_finding::cost_t)c))) {
+                    fail_at = (ebnf_finding::cost_t)c;
+                    known = true;
+                }
+            }
+            if (!known) {
+                usage();
+                return 2;
+            }
+            i++;
+        } else if (argv[i][0] == '-') {
+            usage();
+            return 2;
+        } else {
+            names.push_back(argv[i]);
+        }
+    }
+    if (names.empty()) {
+        names = { "ebnf", "expression" };
+    }
+
+    int rv = 0;
+    for (auto &name:names) {
+        auto grammar = grammar_named(name);
+        if (!grammar) {
+            fprintf(stderr, "sciconf-analyze: no grammar called %s\n", name.c_str());
+            usage();
+            return 2;
+        }
+        for (auto &missing:grammar->link()) {
+            printf("%s: %s isn't defined\n", name.c_str(), missing.c_str());
+        }
+
+        auto analysis = ebnf_analysis::New(*grammar);
+        auto &findings(analysis->findings());
+        printf("%s: %zu finding%s\n", name.c_str(), findings.size(), (findings.size() == 1) ? "" : "s");
+
+        for (auto &f:findings) {
+            printf("  %-11s %-20s %s%s%s\n", ebnf_finding::cost_name(f.cost),
+                   ebnf_finding::kind_name(f.kind), f.rule.c_str(),
+                   f.where.empty() ? "" : ": ", f.where.c_str());
+            printf("      %s\n", f.message.c_str());
+        }
+        if (show_sets) {
+            print_sets(*grammar, analysis->sets());
+        }
+
+        if (!findings.empty() && (analysis->worst() >= fail_at)) {
+            rv = 1;
+        }
+    }
+    return rv;
+}